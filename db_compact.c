@@ -0,0 +1,394 @@
+/**
+ * @file db_compact.c
+ * @brief pictDB library: incremental (online) compaction.
+ *
+ * Instead of copying the whole database into a new file (do_gbcollect),
+ * each compaction step moves a bounded amount of live images, starting
+ * from the end of the file, down into the holes left by deleted pictures
+ * and updates their offsets in place. Once the end of the file only
+ * contains dead bytes, the file is truncated.
+ *
+ * An image is always copied to a free area before its metadata is
+ * updated, and never overwrites its own old copy, so that an interrupted
+ * step never loses a picture. The metadata and the header are updated
+ * once per step, through the journal when one is attached. Pinned images (being sent by the server)
+ * are neither moved nor truncated, even once they are dead.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fsync, ftruncate and fileno
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "db_journal.h" //for journal_commit and journal_checkpoint
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // for calloc, qsort and free
+#include <unistd.h> // for fsync and ftruncate
+
+/* Slot of the pseudo-references standing for metadata chunks, which never move. */
+#define CHUNK_SLOT UINT32_MAX
+/* Slot of the pseudo-references standing for pinned images, which do not move either. */
+#define PINNED_SLOT (UINT32_MAX - 1)
+
+/*! \struct blob_ref
+    \brief One reference (slot, resolution) to an image stored in the file.
+*/
+struct blob_ref {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t slot;
+    int resolution;
+};
+
+/*! \struct blob_hole
+    \brief A free area of the file, between two live images.
+*/
+struct blob_hole {
+    uint64_t start;
+    uint64_t length;
+};
+
+/********************************************************************//*
+ * Flushes and syncs the database file.
+ */
+static int sync_db(struct pictdb_file* db_file)
+{
+    if (fflush(db_file->fpdb) != 0 || fsync(fileno(db_file->fpdb)) != 0) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Orders the references by offset (then by slot, so that the order is total).
+ */
+static int compare_refs(const void* a, const void* b)
+{
+    const struct blob_ref* ref_a = a;
+    const struct blob_ref* ref_b = b;
+    if (ref_a->offset != ref_b->offset) {
+        return ref_a->offset < ref_b->offset ? -1 : 1;
+    }
+    if (ref_a->slot != ref_b->slot) {
+        return ref_a->slot < ref_b->slot ? -1 : 1;
+    }
+    return ref_a->resolution - ref_b->resolution;
+}
+
+/********************************************************************//*
+ * Returns the position of the first image (end of the metadata array).
+ */
+static uint64_t data_start(struct pictdb_file const* db_file)
+{
+    return sizeof(struct pictdb_header) + (uint64_t) db_file->header.max_files * sizeof(struct pict_metadata);
+}
+
+/********************************************************************//*
+ * Collects every reference to a stored image, sorted by offset.
+ * Images shared by deduplicated pictures appear once per reference.
+ * Metadata chunks (format 1) appear as references to CHUNK_SLOT, and
+ * pinned images (live or not) as one more reference to PINNED_SLOT.
+ */
+static int collect_refs(struct pictdb_file const* db_file, struct blob_ref** refs, size_t* nb_refs)
+{
+    const struct pictdb_index* index = db_file->index;
+    const uint32_t capacity = db_capacity(db_file);
+    *refs = calloc((size_t) capacity * NB_RES + index->nb_chunks + index->nb_blobs + 1, sizeof(struct blob_ref));
+    if (*refs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    size_t nb = 0;
+    for (uint32_t c = 0; c < index->nb_chunks; ++c) {
+        (*refs)[nb].offset = index->chunks[c].position;
+        (*refs)[nb].size = sizeof(struct metadata_chunk_header)
+                           + index->chunks[c].nb_slots * sizeof(struct pict_metadata);
+        (*refs)[nb].slot = CHUNK_SLOT;
+        (*refs)[nb].resolution = 0;
+        ++nb;
+    }
+    for (uint32_t b = 0; b < index->blob_capacity; ++b) {
+        if (index->blobs[b].offset != 0 && index->blobs[b].pins > 0) {
+            (*refs)[nb].offset = index->blobs[b].offset;
+            (*refs)[nb].size = index->blobs[b].size;
+            (*refs)[nb].slot = PINNED_SLOT;
+            (*refs)[nb].resolution = 0;
+            ++nb;
+        }
+    }
+    for (uint32_t i = 0; i < capacity; ++i) {
+        if (!index_slot_valid(index, i)) {
+            continue;
+        }
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for (int res = 0; res < NB_RES; ++res) {
+            if (metadata->offset[res] != 0 && metadata->size[res] != 0) {
+                (*refs)[nb].offset = metadata->offset[res];
+                (*refs)[nb].size = metadata->size[res];
+                (*refs)[nb].slot = i;
+                (*refs)[nb].resolution = res;
+                ++nb;
+            }
+        }
+    }
+    qsort(*refs, nb, sizeof(struct blob_ref), compare_refs);
+    *nb_refs = nb;
+    return 0;
+}
+
+/********************************************************************//*
+ * Returns the size of the image stored at refs[first] (the largest size
+ * of all its references) and the index after its last reference.
+ */
+static uint32_t extent_of(const struct blob_ref* refs, size_t nb_refs, size_t first, size_t* next)
+{
+    uint32_t size = refs[first].size;
+    size_t k = first + 1;
+    while (k < nb_refs && refs[k].offset == refs[first].offset) {
+        if (refs[k].size > size) {
+            size = refs[k].size;
+        }
+        ++k;
+    }
+    *next = k;
+    return size;
+}
+
+/********************************************************************//*
+ * Lists the holes between the live images, in increasing order.
+ */
+static int collect_holes(struct pictdb_file const* db_file, const struct blob_ref* refs, size_t nb_refs,
+                         struct blob_hole** holes, size_t* nb_holes)
+{
+    *holes = calloc(nb_refs + 1, sizeof(struct blob_hole));
+    if (*holes == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    size_t nb = 0;
+    uint64_t cursor = data_start(db_file);
+    size_t k = 0;
+    while (k < nb_refs) {
+        size_t next = 0;
+        uint32_t size = extent_of(refs, nb_refs, k, &next);
+        if (refs[k].offset > cursor) {
+            (*holes)[nb].start = cursor;
+            (*holes)[nb].length = refs[k].offset - cursor;
+            ++nb;
+        }
+        if (refs[k].offset + size > cursor) {
+            cursor = refs[k].offset + size;
+        }
+        k = next;
+    }
+    *nb_holes = nb;
+    return 0;
+}
+
+/********************************************************************//*
+ * Copies the image referenced by refs[first..next[ to new_offset, then
+ * updates the metadata referencing it in memory, widening the range
+ * [*first_dirty, *last_dirty] of the entries to write.
+ */
+static int move_extent(struct pictdb_file* db_file, struct blob_ref* refs, size_t first, size_t next,
+                       uint32_t size, uint64_t new_offset, uint32_t* first_dirty, uint32_t* last_dirty)
+{
+    char* image = NULL;
+    int status = read_image_at(db_file, refs[first].offset, size, &image);
+    if (status) {
+        return status;
+    }
+
+    if (fseek(db_file->fpdb, new_offset, SEEK_SET) != 0
+        || fwrite(image, size, 1, db_file->fpdb) != 1) {
+        free_the_buffer(&image);
+        return ERR_IO;
+    }
+    free_the_buffer(&image);
+
+    status = index_move_blob(db_file, refs[first].offset, new_offset);
+    if (status) {
+        return status;
+    }
+    for (size_t k = first; k < next; ++k) {
+        db_file->metadata[refs[k].slot].offset[refs[k].resolution] = new_offset;
+        if (refs[k].slot < *first_dirty) {
+            *first_dirty = refs[k].slot;
+        }
+        if (refs[k].slot > *last_dirty) {
+            *last_dirty = refs[k].slot;
+        }
+        refs[k].offset = new_offset;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Écrit sur le disque les metadata des entrées first à last, modifiées
+ * par les déplacements, puis le header. Si un journal est attaché, la
+ * mise à jour y est d'abord enregistrée.
+ */
+static int write_moves(struct pictdb_file* db_file, uint32_t first, uint32_t last)
+{
+    //les copies doivent être sur le disque (et pas seulement dans le cache) avant que les metadata ne les référencent
+    int status = sync_db(db_file);
+    if (status) {
+        return status;
+    }
+    status = journal_commit(db_file, first, last);
+    if (status) {
+        return status;
+    }
+
+    status = write_metadata_range(db_file, first, last);
+    if (status) {
+        return status;
+    }
+    if (fseek(db_file->fpdb, 0, SEEK_SET) != 0
+        || fwrite(&db_file->header, sizeof(struct pictdb_header), 1, db_file->fpdb) != 1) {
+        return ERR_IO;
+    }
+    status = journal_checkpoint(db_file);
+    if (status) {
+        return status;
+    }
+    //les metadata et le header doivent référencer les nouvelles copies, sur le disque, avant que les anciennes ne disparaissent
+    return sync_db(db_file);
+}
+
+/********************************************************************//*
+ * Performs one bounded step of incremental compaction.
+ */
+int do_compact_step(struct pictdb_file* db_file, uint64_t max_bytes, uint64_t* moved_bytes, int* finished)
+{
+    if (db_file == NULL || db_file->fpdb == NULL || db_file->index == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (db_file->index->mapping != NULL) {
+        //base projetée en lecture seule
+        return ERR_INVALID_ARGUMENT;
+    }
+    *moved_bytes = 0;
+    *finished = 0;
+
+    //les images mortes désépinglées depuis l'étape précédente laissent des trous
+    int release_status = index_release_unpinned(db_file);
+    if (release_status) {
+        return release_status;
+    }
+
+    //read_image_at lit le fichier directement : les écritures en attente doivent y être
+    if (fflush(db_file->fpdb) != 0) {
+        return ERR_IO;
+    }
+
+    struct blob_ref* refs = NULL;
+    size_t nb_refs = 0;
+    int status = collect_refs(db_file, &refs, &nb_refs);
+    if (status) {
+        return status;
+    }
+    struct blob_hole* holes = NULL;
+    size_t nb_holes = 0;
+    status = collect_holes(db_file, refs, nb_refs, &holes, &nb_holes);
+    if (status) {
+        free(refs);
+        return status;
+    }
+
+    //extents (groups of references to the same image), from the end of the file
+    size_t* extent_starts = calloc(nb_refs + 1, sizeof(size_t));
+    if (extent_starts == NULL) {
+        free(holes);
+        free(refs);
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_extents = 0;
+    for (size_t k = 0; k < nb_refs; ) {
+        extent_starts[nb_extents++] = k;
+        size_t next = 0;
+        (void) extent_of(refs, nb_refs, k, &next);
+        k = next;
+    }
+
+    int moved_any = 0;
+    int pinned_waiting = 0;
+    uint32_t first_dirty = UINT32_MAX;
+    uint32_t last_dirty = 0;
+    for (size_t e = nb_extents; e > 0 && !status; --e) {
+        const size_t first = extent_starts[e - 1];
+        size_t next = 0;
+        const uint32_t size = extent_of(refs, nb_refs, first, &next);
+        if (refs[next - 1].slot == CHUNK_SLOT) {
+            //les blocs de metadata sont chaînés par leur position : ils restent en place
+            continue;
+        }
+
+        //premier trou (le plus bas) placé avant l'image et assez grand pour la contenir
+        size_t h = 0;
+        while (h < nb_holes && holes[h].start < refs[first].offset && holes[h].length < size) {
+            ++h;
+        }
+        const int movable = h < nb_holes && holes[h].start < refs[first].offset;
+        if (refs[next - 1].slot == PINNED_SLOT) {
+            /*image en cours de lecture (la pseudo-référence est triée en dernier) : elle reste en place,
+            et sera déplacée, ou tronquée si elle est morte, à une étape suivante*/
+            pinned_waiting |= movable || next - first == 1;
+            continue;
+        }
+        if (!movable) {
+            continue;
+        }
+        if (moved_any && *moved_bytes + size > max_bytes) {
+            //budget épuisé : le reste sera déplacé à l'étape suivante
+            break;
+        }
+
+        status = move_extent(db_file, refs, first, next, size, holes[h].start, &first_dirty, &last_dirty);
+        if (!status) {
+            holes[h].start += size;
+            holes[h].length -= size;
+            *moved_bytes += size;
+            moved_any = 1;
+        }
+    }
+
+    //fin du fichier : juste après la dernière image encore vivante
+    uint64_t end = data_start(db_file);
+    for (size_t k = 0; k < nb_refs; ++k) {
+        if (refs[k].offset + refs[k].size > end) {
+            end = refs[k].offset + refs[k].size;
+        }
+    }
+
+    if (moved_any) {
+        //les déplacements déjà faits en mémoire sont écrits, même si le suivant a échoué
+        db_file->header.db_version += 1;
+        int write_status = write_moves(db_file, first_dirty, last_dirty);
+        if (!status) {
+            status = write_status;
+        }
+    }
+    if (!status && ftruncate(fileno(db_file->fpdb), end) != 0) {
+        status = ERR_IO;
+    }
+    if (!status) {
+        //les trous ont été remplis et la fin du fichier tronquée
+        status = index_build_free_extents(db_file);
+    }
+    /*les places libérées par les images déplacées peuvent accueillir d'autres images :
+    la compaction n'est terminée que lorsqu'une étape ne déplace plus rien, ni n'attend d'image épinglée*/
+    if (!status && !moved_any && !pinned_waiting) {
+        *finished = 1;
+    }
+
+    free(extent_starts);
+    free(holes);
+    free(refs);
+    return status;
+}
@@ -49,10 +49,12 @@ int do_create(struct pictdb_file* db_file, char const* file_name)
     //initialisation du db_header: (avec initialisation par défaut à 0 ou '\0' pour les différents champs int et/ou char)
     db_file->header.db_version = 0;
     db_file->header.num_files = 0;
-    db_file->header.unused_32 = 0;
-    db_file->header.unused_64 = 0;
+    //version du format (voir pictDB.h), les options données par l'appelant sont gardées
+    db_file->header.unused_32 = PICTDB_FORMAT_CURRENT | (db_file->header.unused_32 & PICTDB_FLAGS_MASK);
+    db_file->header.unused_64 = 0; //pas encore de bloc de metadata supplémentaire
 
     db_file->metadata = NULL;
+    db_file->index = NULL;
     //On doit d'abord s'assurer de la validité de max files, puis regarder si l'allocation dynamique a marché correctement
     if(db_file->header.max_files > 0 && db_file->header.max_files <= MAX_MAX_FILES) {
         db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
@@ -98,5 +100,7 @@ int do_create(struct pictdb_file* db_file, char const* file_name)
     }
 
     printf("%d item(s) written\n", items);
-    return 0;
+
+    //construction de l'index (vide) pour pouvoir insérer directement dans la nouvelle base
+    return build_index(db_file);
 }
\ No newline at end of file
@@ -8,6 +8,8 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h" //for index_find_id, index_remove_slot, index_unref_slot_blobs and index_push_free_slot
+#include "db_journal.h" //for journal_commit and journal_checkpoint
 
 #include <string.h>
 #include <stdio.h> // for fseek and fwrite
@@ -22,55 +24,62 @@ int do_delete(const char* pictID, struct pictdb_file* pictdb_file)
         return ERR_INVALID_PICID;
     }
     //recherche de la référence à l'image qui a le même nom dans la base de donnée
-    int ID_not_found = 1; //pour renvoyer une erreur si aucune image dans la base de donnée n'a cet identifiant
+    int found_index = index_find_id(pictdb_file, pictID);
+    int ID_not_found = (found_index < 0); //pour renvoyer une erreur si aucune image dans la base de donnée n'a cet identifiant
     size_t pictNumber = 0; //pour se placer à la bonne image dans la metadata
-    for (int i = 0; i < pictdb_file->header.max_files; ++i) {
-        size_t size_of_pictid = strlen(pictID) + 1;
-        if(!strncmp(pictdb_file->metadata[i].pict_id, pictID, size_of_pictid) && pictdb_file->metadata[i].is_valid == NON_EMPTY) {
-            ID_not_found = 0;
-            pictNumber = i;
-            //invalidation de la référence en écrivant la valeur 0 dans is_valid
-            pictdb_file->metadata[i].is_valid = EMPTY;
+    int unrefStatus = 0;
+    if (!ID_not_found) {
+        pictNumber = found_index;
+        //retrait de l'image de l'index avant son invalidation
+        index_remove_slot(pictdb_file, pictNumber);
+        //les images de l'entrée perdent une référence (elles sont mortes si plus personne ne les partage)
+        unrefStatus = index_unref_slot_blobs(pictdb_file, pictNumber);
+        //invalidation de la référence en écrivant la valeur 0 dans is_valid
+        pictdb_file->metadata[pictNumber].is_valid = EMPTY;
 
-            //pour s'assurer que do_read detectera l'absence de thumb/small même si une image fut dans cette métadata précdemment
-            pictdb_file->metadata[i].offset[RES_THUMB] = 0;
-            pictdb_file->metadata[i].offset[RES_SMALL] = 0;
+        //pour s'assurer que do_read detectera l'absence de thumb/small même si une image fut dans cette métadata précdemment
+        pictdb_file->metadata[pictNumber].offset[RES_THUMB] = 0;
+        pictdb_file->metadata[pictNumber].offset[RES_SMALL] = 0;
 
-        }
+        //l'entrée est de nouveau disponible pour do_insert
+        index_push_free_slot(pictdb_file, pictNumber);
     }
     if (ID_not_found) {
         //renvoie d'une erreur si l'image n'est pas trouvée
         return ERR_INVALID_PICID;
     } else {
 
-        //écriture des métadonnées sur le disque
-        //positionnement
-        long initialOffset = sizeof(struct pictdb_header) + pictNumber * sizeof(struct pict_metadata);
-        int fseekStatus = fseek(pictdb_file->fpdb, initialOffset, SEEK_SET); //on se place au bon pictID dans la metadata
-        if (fseekStatus != 0) {
-            return ERR_IO;
-        }
-        //écriture
-        int numberOfItems = fwrite(&(pictdb_file->metadata[pictNumber]), sizeof(struct pict_metadata), 1, pictdb_file->fpdb);
-        if (numberOfItems != 1) {
-            return ERR_IO;
-        }
-
-        //mise à jour du header en cas de succès
+        //mise à jour du header en mémoire
         pictdb_file->header.num_files -= 1; //on diminue de 1 le nombre d'images dans la base de donnée
         pictdb_file->header.db_version += 1; //on augmente de 1 le numéro de version de la base de donnée
 
+        //enregistrement de la mise à jour dans le journal (s'il y en a un), avant de l'écrire en place
+        int journalStatus = journal_commit(pictdb_file, pictNumber, pictNumber);
+        if (journalStatus != 0) {
+            return journalStatus;
+        }
+
+        //écriture des métadonnées sur le disque
+        //(l'entrée peut se trouver dans un bloc de metadata supplémentaire)
+        int writeStatus = write_metadata_range(pictdb_file, pictNumber, pictNumber);
+        if (writeStatus != 0) {
+            return writeStatus;
+        }
+
         //écriture du header sur le disque
         //positionnement
-        fseekStatus = fseek(pictdb_file->fpdb, 0, SEEK_SET); //on se place au premier pict_id dans la metadata
+        int fseekStatus = fseek(pictdb_file->fpdb, 0, SEEK_SET); //on se place au premier pict_id dans la metadata
         if (fseekStatus != 0) {
             return ERR_IO;
         }
         //écriture
-        numberOfItems = fwrite(&(pictdb_file->header), sizeof(struct pictdb_header), 1, pictdb_file->fpdb);
+        int numberOfItems = fwrite(&(pictdb_file->header), sizeof(struct pictdb_header), 1, pictdb_file->fpdb);
         if (numberOfItems != 1 || ferror(pictdb_file->fpdb)) {
             return ERR_IO;
         }
+        int checkpointStatus = journal_checkpoint(pictdb_file);
+        //l'image est supprimée, mais une place libérée n'a peut-être pas pu être enregistrée (retrouvée à la prochaine ouverture)
+        return checkpointStatus != 0 ? checkpointStatus : unrefStatus;
     }
 
     return 0;
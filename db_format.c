@@ -0,0 +1,271 @@
+/**
+ * @file db_format.c
+ * @brief pictDB library: on-disk layout of the metadata (format versions).
+ *
+ * A format 0 database only has the max_files metadata following the
+ * header. A format 1 database can be extended with chunks of metadata
+ * appended to the file (see struct metadata_chunk_header); in memory, all
+ * the entries are kept in one array, so that a slot is an index in
+ * db_file->metadata whatever its place in the file.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pread and fileno
+
+#include "pictDB.h"
+#include "db_index.h"
+
+#include <errno.h>
+#include <stddef.h> // for offsetof
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // for realloc
+#include <string.h>
+#include <unistd.h> // for pread
+
+/* Max. number of chunks followed when loading (guards against a corrupted, looping chain). */
+#define MAX_METADATA_CHUNKS 4096
+
+/********************************************************************//*
+ * Returns the total number of metadata entries.
+ */
+uint32_t db_capacity(struct pictdb_file const* db_file)
+{
+    if (db_file->index != NULL && db_file->index->nb_slots != 0) {
+        return db_file->index->nb_slots;
+    }
+    return db_file->header.max_files;
+}
+
+/********************************************************************//*
+ * Returns the chunk holding slot, NULL if it is in the array following the header.
+ */
+static const struct metadata_chunk* chunk_of(struct pictdb_file const* db_file, uint32_t slot)
+{
+    if (slot < db_file->header.max_files || db_file->index == NULL) {
+        return NULL;
+    }
+    //les blocs sont rangés par premier slot croissant
+    const struct pictdb_index* index = db_file->index;
+    for (uint32_t c = index->nb_chunks; c > 0; --c) {
+        if (slot >= index->chunks[c - 1].first_slot) {
+            return &index->chunks[c - 1];
+        }
+    }
+    return NULL;
+}
+
+/********************************************************************//*
+ * Returns the position in the file of a metadata entry.
+ */
+uint64_t metadata_position(struct pictdb_file const* db_file, uint32_t slot)
+{
+    const struct metadata_chunk* chunk = chunk_of(db_file, slot);
+    if (chunk == NULL) {
+        return sizeof(struct pictdb_header) + (uint64_t) slot * sizeof(struct pict_metadata);
+    }
+    return chunk->position + sizeof(struct metadata_chunk_header)
+           + (uint64_t) (slot - chunk->first_slot) * sizeof(struct pict_metadata);
+}
+
+/********************************************************************//*
+ * Writes the metadata entries first to last (included), one write per
+ * contiguous part (the array following the header, then each chunk).
+ */
+int write_metadata_range(struct pictdb_file* db_file, uint32_t first, uint32_t last)
+{
+    uint32_t slot = first;
+    while (slot <= last) {
+        //fin de la partie contiguë contenant slot
+        uint32_t part_end = db_file->header.max_files;
+        const struct metadata_chunk* chunk = chunk_of(db_file, slot);
+        if (chunk != NULL) {
+            part_end = chunk->first_slot + chunk->nb_slots;
+        }
+        const uint32_t end = last + 1 < part_end ? last + 1 : part_end;
+
+        if (fseek(db_file->fpdb, metadata_position(db_file, slot), SEEK_SET) != 0) {
+            return ERR_IO;
+        }
+        const size_t nb_metadata = end - slot;
+        if (fwrite(&db_file->metadata[slot], sizeof(struct pict_metadata), nb_metadata, db_file->fpdb) != nb_metadata) {
+            return ERR_IO;
+        }
+        slot = end;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Reads exactly size bytes at offset (without moving the FILE position).
+ */
+static int read_exact(struct pictdb_file const* db_file, uint64_t offset, void* buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t nb_read = pread(fileno(db_file->fpdb), (char*) buffer + done, size - done, offset + done);
+        if (nb_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb_read <= 0) {
+            return ERR_IO;
+        }
+        done += nb_read;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Appends a chunk to the in-memory list of chunks.
+ */
+static int add_chunk(struct pictdb_index* index, uint64_t position, uint32_t nb_slots)
+{
+    struct metadata_chunk* chunks = realloc(index->chunks, (index->nb_chunks + 1) * sizeof(struct metadata_chunk));
+    if (chunks == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->chunks = chunks;
+    chunks[index->nb_chunks].position = position;
+    chunks[index->nb_chunks].first_slot = index->nb_slots;
+    chunks[index->nb_chunks].nb_slots = nb_slots;
+    ++index->nb_chunks;
+    return 0;
+}
+
+/********************************************************************//*
+ * Loads the metadata chunks of a format 1 database.
+ */
+int load_metadata_chunks(struct pictdb_file* db_file)
+{
+    struct pictdb_index* index = db_file->index;
+    index->nb_slots = db_file->header.max_files;
+    if (PICTDB_FORMAT(db_file->header) < PICTDB_FORMAT_CHUNKED) {
+        return 0;
+    }
+    if (PICTDB_FORMAT(db_file->header) > PICTDB_FORMAT_CURRENT) {
+        //format plus récent que ce programme
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint64_t position = db_file->header.unused_64;
+    while (position != 0) {
+        struct metadata_chunk_header chunk;
+        int read_status = read_exact(db_file, position, &chunk, sizeof(chunk));
+        if (read_status) {
+            return read_status;
+        }
+        if (memcmp(chunk.magic, METADATA_CHUNK_MAGIC, sizeof(chunk.magic)) != 0 || chunk.nb_slots == 0
+            || index->nb_chunks >= MAX_METADATA_CHUNKS
+            || (uint64_t) index->nb_slots + chunk.nb_slots > MAX_TOTAL_FILES) {
+            return ERR_MAX_FILES;
+        }
+
+        const uint32_t total = index->nb_slots + chunk.nb_slots;
+        struct pict_metadata* metadata = realloc(db_file->metadata, (size_t) total * sizeof(struct pict_metadata));
+        if (metadata == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        db_file->metadata = metadata;
+        read_status = read_exact(db_file, position + sizeof(chunk), &metadata[index->nb_slots],
+                                 (size_t) chunk.nb_slots * sizeof(struct pict_metadata));
+        if (read_status) {
+            return read_status;
+        }
+
+        int add_status = add_chunk(index, position, chunk.nb_slots);
+        if (add_status) {
+            return add_status;
+        }
+        index->nb_slots = total;
+        position = chunk.next_chunk;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Adds a chunk of empty metadata entries to a format 1 database.
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t nb_slots)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || index->mapping != NULL || nb_slots == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (PICTDB_FORMAT(db_file->header) < PICTDB_FORMAT_CHUNKED) {
+        //une base au format 0 a un nombre fixe d'entrées
+        return ERR_FULL_DATABASE;
+    }
+    const uint32_t old_nb_slots = index->nb_slots;
+    if ((uint64_t) old_nb_slots + nb_slots > MAX_TOTAL_FILES) {
+        return ERR_FULL_DATABASE;
+    }
+
+    //nouvelles entrées (vides) en mémoire
+    struct pict_metadata* metadata = realloc(db_file->metadata,
+                                             ((size_t) old_nb_slots + nb_slots) * sizeof(struct pict_metadata));
+    if (metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    db_file->metadata = metadata;
+    memset(&metadata[old_nb_slots], 0, (size_t) nb_slots * sizeof(struct pict_metadata));
+
+    //écriture du bloc à la fin du fichier, avant de le chaîner (un bloc non chaîné n'est que de l'espace mort)
+    if (fseek(db_file->fpdb, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+    long end_of_file = ftell(db_file->fpdb);
+    if (end_of_file < 0) {
+        return ERR_IO;
+    }
+    const uint64_t position = end_of_file;
+
+    struct metadata_chunk_header chunk;
+    memset(&chunk, 0, sizeof(chunk));
+    memcpy(chunk.magic, METADATA_CHUNK_MAGIC, sizeof(chunk.magic));
+    chunk.nb_slots = nb_slots;
+    chunk.next_chunk = 0;
+    if (fwrite(&chunk, sizeof(chunk), 1, db_file->fpdb) != 1
+        || fwrite(&metadata[old_nb_slots], sizeof(struct pict_metadata), nb_slots, db_file->fpdb) != nb_slots
+        || fflush(db_file->fpdb) != 0) {
+        return ERR_IO;
+    }
+
+    /*le header est réécrit tel qu'il est sur le disque, avec seulement le chaînage et la version changés :
+    celui en mémoire peut contenir des mises à jour (d'un lot en cours) pas encore écrites ni journalisées*/
+    struct pictdb_header disk_header;
+    if (pread(fileno(db_file->fpdb), &disk_header, sizeof(struct pictdb_header), 0)
+        != (ssize_t) sizeof(struct pictdb_header)) {
+        return ERR_IO;
+    }
+
+    //chaînage : depuis le header pour le premier bloc, sinon depuis le bloc précédent
+    if (index->nb_chunks == 0) {
+        disk_header.unused_64 = position;
+        db_file->header.unused_64 = position;
+    } else {
+        const uint64_t link = index->chunks[index->nb_chunks - 1].position
+                              + offsetof(struct metadata_chunk_header, next_chunk);
+        if (fseek(db_file->fpdb, link, SEEK_SET) != 0
+            || fwrite(&position, sizeof(position), 1, db_file->fpdb) != 1) {
+            return ERR_IO;
+        }
+    }
+    disk_header.db_version += 1;
+    db_file->header.db_version += 1;
+    if (fseek(db_file->fpdb, 0, SEEK_SET) != 0
+        || fwrite(&disk_header, sizeof(struct pictdb_header), 1, db_file->fpdb) != 1
+        || fflush(db_file->fpdb) != 0) {
+        return ERR_IO;
+    }
+
+    //mise à jour de l'index
+    int add_status = add_chunk(index, position, nb_slots);
+    if (add_status) {
+        return add_status;
+    }
+    index->nb_slots = old_nb_slots + nb_slots;
+    return index_grow(db_file, old_nb_slots);
+}
@@ -7,79 +7,176 @@
  * @date Mai 2016
  */
 
+#define _GNU_SOURCE // for copy_file_range (and pread, pwrite, fileno)
+
 #include "pictDB.h"
+#include "db_index.h" //for index_slot_valid
+#include <errno.h>
 #include <stdlib.h> //for calloc
 #include <stdio.h> //for rename and remove
 #include <string.h>
+#include <unistd.h> //for pread and pwrite
 
 #define current db_file->metadata[i]
+//taille des blocs des copies brutes (lectures et écritures séquentielles)
+#define GC_COPY_CHUNK (1024 * 1024)
+#define MIN_REMAP_CAPACITY 16
+#define REMAP_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+/*! \struct offset_remap
+    \brief Table (adressage ouvert, sondage linéaire) des images déjà copiées :
+    ancien offset -> nouvel offset. Un offset nul marque une case vide
+    (aucune image n'est à l'offset 0, occupé par le header).
+*/
+struct offset_remap {
+    uint64_t capacity; // puissance de 2
+    uint64_t* old_offsets;
+    uint64_t* new_offsets;
+};
+
+/********************************************************************//*
+ * Alloue une table de correspondance pouvant contenir nb_blobs images.
+ */
+static int remap_init(struct offset_remap* remap, uint64_t nb_blobs)
+{
+    remap->capacity = MIN_REMAP_CAPACITY;
+    while (remap->capacity < 2 * nb_blobs) {
+        remap->capacity <<= 1;
+    }
+    remap->old_offsets = calloc(remap->capacity, sizeof(uint64_t));
+    remap->new_offsets = calloc(remap->capacity, sizeof(uint64_t));
+    if (remap->old_offsets == NULL || remap->new_offsets == NULL) {
+        free(remap->old_offsets);
+        free(remap->new_offsets);
+        remap->old_offsets = remap->new_offsets = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+    return 0;
+}
 
-int read_and_write_image(struct pictdb_file* db_file, struct pictdb_file* tmp_pictdb_file, int i, const int resolution_code)
+static void remap_free(struct offset_remap* remap)
 {
-    //lecture
-    char * image_buffer = NULL;
-    uint32_t image_size = 0;
-    unsigned int errorRead = do_read(current.pict_id, resolution_code, &image_buffer, &image_size, db_file);
-    if(errorRead) {
-        free_the_buffer(&image_buffer);
-        do_close(db_file);
-        return errorRead;
-    }
-
-    if (resolution_code == RES_ORIG) {
-        //écriture
-        int errorStatus = do_insert(image_buffer, image_size, current.pict_id, tmp_pictdb_file);
-        if(errorStatus) {
-            free_the_buffer(&image_buffer);
-            do_close(db_file);
-            return errorStatus;
+    free(remap->old_offsets);
+    free(remap->new_offsets);
+    remap->old_offsets = remap->new_offsets = NULL;
+}
+
+/********************************************************************//*
+ * Renvoie la case de old_offset dans la table (ou la case vide où l'ajouter).
+ */
+static uint64_t remap_bucket(const struct offset_remap* remap, uint64_t old_offset)
+{
+    const uint64_t mask = remap->capacity - 1;
+    uint64_t b = (old_offset * REMAP_HASH_MULTIPLIER) & mask;
+    while (remap->old_offsets[b] != 0 && remap->old_offsets[b] != old_offset) {
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+/********************************************************************//*
+ * Copie brute de size octets, de la position src_offset du fichier src_fd
+ * à la position dst_offset du fichier dst_fd, sans décoder l'image.
+ * Utilise copy_file_range (copie dans le noyau) quand c'est possible,
+ * sinon des lectures et écritures par gros blocs.
+ */
+static int copy_blob(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t size,
+                     char* chunk)
+{
+#ifdef __linux__
+    loff_t in = src_offset;
+    loff_t out = dst_offset;
+    uint64_t left = size;
+    while (left > 0) {
+        ssize_t copied = copy_file_range(src_fd, &in, dst_fd, &out, left, 0);
+        if (copied <= 0) {
+            if (copied < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        left -= copied;
+    }
+    if (left == 0) {
+        return 0;
+    }
+    //copy_file_range non supporté (ou interrompu) : la suite est copiée par blocs
+    src_offset = in;
+    dst_offset = out;
+    size = left;
+#endif
+
+    while (size > 0) {
+        size_t to_copy = size < GC_COPY_CHUNK ? size : GC_COPY_CHUNK;
+        ssize_t nb_read = pread(src_fd, chunk, to_copy, src_offset);
+        if (nb_read < 0 && errno == EINTR) {
+            continue;
         }
-    } else {
-        //copie du contenu de l'image à la fin du fichier pictDB
-        int fseek_status = fseek(tmp_pictdb_file->fpdb, 0, SEEK_END);
-        if (fseek_status != 0) {
-            free_the_buffer(&image_buffer);
+        if (nb_read <= 0) {
             return ERR_IO;
         }
+        size_t written = 0;
+        while (written < (size_t) nb_read) {
+            ssize_t nb_written = pwrite(dst_fd, chunk + written, nb_read - written, dst_offset + written);
+            if (nb_written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nb_written <= 0) {
+                return ERR_IO;
+            }
+            written += nb_written;
+        }
+        src_offset += nb_read;
+        dst_offset += nb_read;
+        size -= nb_read;
+    }
+    return 0;
+}
 
-        uint64_t offset_for_metadata = ftell(tmp_pictdb_file->fpdb);
+/********************************************************************//*
+ * Copie la metadata de l'image i telle quelle dans la base temporaire et
+ * ses images (brutes) à la fin du fichier temporaire. Chaque image physique
+ * n'est copiée qu'une fois : les images partagées (déduplication) sont
+ * retrouvées par leur ancien offset dans la table de correspondance.
+ */
+static int copy_picture(struct pictdb_file* db_file, struct pictdb_file* tmp_pictdb_file, uint32_t i,
+                        struct offset_remap* remap, uint64_t* end_of_file, char* chunk)
+{
+    struct pict_metadata* copy = &tmp_pictdb_file->metadata[i];
+    *copy = current;
 
-        int written = fwrite(image_buffer, image_size, 1, tmp_pictdb_file->fpdb);
-        if (written != 1) {
-            free_the_buffer(&image_buffer);
-            return ERR_IO;
+    for (int res = 0; res < NB_RES; ++res) {
+        if (current.offset[res] == 0 || current.size[res] == 0) {
+            copy->offset[res] = 0;
+            copy->size[res] = 0;
+            continue;
         }
 
-        //mise à jour des metadatas en mémoire
-        tmp_pictdb_file->metadata[i].offset[resolution_code] = offset_for_metadata; //endroit où l'image réduite est stockée
-        tmp_pictdb_file->metadata[i].size[resolution_code] = image_size; //taille de l'image réduite
-
-        //mise à jour des metadatas sur le disque
-        //positionnement
-        long initial_offset_for_metadata = sizeof(struct pictdb_header) + i * sizeof(struct pict_metadata);
-        fseek_status = fseek(tmp_pictdb_file->fpdb, initial_offset_for_metadata, SEEK_SET); //on se place au bon pictID dans la metadata
-        if (fseek_status != 0) {
-            free_the_buffer(&image_buffer);
-            return ERR_IO;
+        uint64_t b = remap_bucket(remap, current.offset[res]);
+        if (remap->old_offsets[b] != 0) {
+            //image déjà copiée (partagée avec une autre entrée ou une autre résolution)
+            copy->offset[res] = remap->new_offsets[b];
+            continue;
         }
 
-        //écriture
-        int num_written = fwrite(&tmp_pictdb_file->metadata[i], sizeof(struct pict_metadata), 1, tmp_pictdb_file->fpdb);
-        if (num_written != 1) {
-            free_the_buffer(&image_buffer);
-            return ERR_IO;
+        int copy_status = copy_blob(fileno(db_file->fpdb), current.offset[res], fileno(tmp_pictdb_file->fpdb),
+                                    *end_of_file, current.size[res], chunk);
+        if (copy_status) {
+            return copy_status;
         }
+        remap->old_offsets[b] = current.offset[res];
+        remap->new_offsets[b] = *end_of_file;
+        copy->offset[res] = *end_of_file;
+        *end_of_file += current.size[res];
     }
-
-    //libération mémoire
-    free_the_buffer(&image_buffer);
-
     return 0;
 }
 
 /********************************************************************//*
  * Performs garbage collecting on pictDB.
  * Requires a temporary filename for copying the pictDB.
+ * The metadata are copied verbatim and the images as raw bytes: nothing
+ * is hashed nor decoded again, and each physical image is written once.
  */
 int do_gbcollect(struct pictdb_file* db_file, char const* orig_file_name, char* tmp_file_name)
 {
@@ -93,53 +190,86 @@ int do_gbcollect(struct pictdb_file* db_file, char const* orig_file_name, char*
     }
     //on remplace le header "vide" créé par do_create
     tmp_pictdb_file.header = db_file->header;
+    //la copie est toujours au format courant, avec au plus un bloc de metadata supplémentaire
+    tmp_pictdb_file.header.unused_32 = PICTDB_FORMAT_CURRENT | (db_file->header.unused_32 & PICTDB_FLAGS_MASK);
+    tmp_pictdb_file.header.unused_64 = 0;
+    const uint32_t capacity = db_capacity(db_file);
+    if (capacity > tmp_pictdb_file.header.max_files) {
+        int grow_status = do_grow(&tmp_pictdb_file, capacity - tmp_pictdb_file.header.max_files);
+        if (grow_status) {
+            free_index(&tmp_pictdb_file);
+            do_close(&tmp_pictdb_file);
+            return grow_status;
+        }
+    }
 
-    for (int i = 0; i < tmp_pictdb_file.header.max_files; ++i) {
-        if (current.is_valid == NON_EMPTY) {
-            //copie de l'image originale dans le fichier temporaire
-            int read_and_write_status = read_and_write_image(db_file, &tmp_pictdb_file, i, RES_ORIG);
-            if (read_and_write_status) {
-                fclose(tmp_pictdb_file.fpdb);
-                return read_and_write_status;
-            }
+    //les images sont lues directement dans le fichier original : les écritures en attente doivent y être
+    if (fflush(db_file->fpdb) != 0 || fflush(tmp_pictdb_file.fpdb) != 0) {
+        free_index(&tmp_pictdb_file);
+        do_close(&tmp_pictdb_file);
+        return ERR_IO;
+    }
+    //la table de correspondance doit pouvoir contenir toutes les images des entrées valides
+    uint64_t nb_valid = 0;
+    for (uint32_t i = 0; i < capacity; ++i) {
+        nb_valid += index_slot_valid(db_file->index, i);
+    }
+    struct offset_remap remap;
+    char* chunk = malloc(GC_COPY_CHUNK);
+    if (chunk == NULL || remap_init(&remap, nb_valid * NB_RES)) {
+        free(chunk);
+        free_index(&tmp_pictdb_file);
+        do_close(&tmp_pictdb_file);
+        return ERR_OUT_OF_MEMORY;
+    }
 
-            if (current.size[RES_SMALL] != 0) {
-                //copie de l'image en résolution small dans le fichier temporaire si elle est présente dans la base originale
-                int read_and_write_status = read_and_write_image(db_file, &tmp_pictdb_file, i, RES_SMALL);
-                if (read_and_write_status) {
-                    fclose(tmp_pictdb_file.fpdb);
-                    return read_and_write_status;
-                }
-            }
-            if (current.size[RES_THUMB] != 0) {
-                //copie de l'image en résolution thumb dans le fichier temporaire si elle est présente dans la base originale
-                int read_and_write_status = read_and_write_image(db_file, &tmp_pictdb_file, i, RES_THUMB);
-                if (read_and_write_status) {
-                    fclose(tmp_pictdb_file.fpdb);
-                    return read_and_write_status;
-                }
+    //les images sont écrites à la suite, après le header et les metadata (et l'éventuel bloc supplémentaire)
+    long data_start = -1;
+    if (fseek(tmp_pictdb_file.fpdb, 0, SEEK_END) == 0) {
+        data_start = ftell(tmp_pictdb_file.fpdb);
+    }
+    if (data_start < 0) {
+        remap_free(&remap);
+        free(chunk);
+        free_index(&tmp_pictdb_file);
+        do_close(&tmp_pictdb_file);
+        return ERR_IO;
+    }
+    uint64_t end_of_file = data_start;
+    for (uint32_t i = 0; i < capacity; ++i) {
+        if (index_slot_valid(db_file->index, i)) {
+            int copy_status = copy_picture(db_file, &tmp_pictdb_file, i, &remap, &end_of_file, chunk);
+            if (copy_status) {
+                remap_free(&remap);
+                free(chunk);
+                free_index(&tmp_pictdb_file);
+                do_close(&tmp_pictdb_file);
+                return copy_status;
             }
         }
     }
+    remap_free(&remap);
+    free(chunk);
 
     //pour que la version soit incrémentée de 1 après le gc.
     tmp_pictdb_file.header.db_version = db_file->header.db_version + 1;
 
-    //écriture du header en mémoire
-    int fseek_status = fseek(tmp_pictdb_file.fpdb, 0, SEEK_SET); //on se place au bon pictID dans la metadata
-    if (fseek_status != 0) {
-        return ERR_IO;
-    }
-    int items = fwrite(&(tmp_pictdb_file.header), sizeof(struct pictdb_header), 1, tmp_pictdb_file.fpdb);
-    if(items != 1) {
-        fclose(tmp_pictdb_file.fpdb);
+    //écriture de toutes les metadata (une écriture par partie contiguë), puis du header
+    int write_status = write_metadata_range(&tmp_pictdb_file, 0, capacity - 1);
+    int fseek_status = fseek(tmp_pictdb_file.fpdb, 0, SEEK_SET);
+    size_t items = fwrite(&(tmp_pictdb_file.header), sizeof(struct pictdb_header), 1, tmp_pictdb_file.fpdb);
+    if(write_status || fseek_status != 0 || items != 1) {
+        free_index(&tmp_pictdb_file);
+        do_close(&tmp_pictdb_file);
         return ERR_IO; // I/O error.
     }
 
     //fermeture de la struct temporaire
+    free_index(&tmp_pictdb_file);
     do_close(&tmp_pictdb_file);
 
     //fermeture de la struct originale
+    free_index(db_file);
     do_close(db_file);
 
     int remove_status = remove(orig_file_name);
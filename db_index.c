@@ -0,0 +1,954 @@
+/**
+ * @file db_index.c
+ * @brief pictDB library: in-memory index implementation.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pthread_rwlock_t with -std=c99 and fileno
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "derive_queue.h" //for derive_queue_stop
+#include "db_journal.h" //for journal_close
+
+#include <stdatomic.h> // for the pins, updated under the shared lock
+#include <stdint.h>
+#include <inttypes.h> // for PRIu32
+#include <stdio.h> // for printf
+#include <stdlib.h> // for calloc and free
+#include <string.h>
+#include <sys/stat.h> // for fstat
+
+#define MIN_INDEX_CAPACITY 16
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define BLOB_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+/* type of the functions giving the hash of the key stored at a given slot */
+typedef uint64_t (*slot_hash)(struct pictdb_file const* db_file, uint32_t slot);
+
+/********************************************************************//*
+ * Hashes a picture id (64 bits FNV-1a).
+ */
+uint64_t hash_pict_id(const char* pict_id)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < MAX_PIC_ID + 1 && pict_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) pict_id[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/********************************************************************//*
+ * Hashes a SHA-256 value. The digest is already uniformly distributed,
+ * so its first 8 bytes are used as they are.
+ */
+uint64_t hash_SHA(const unsigned char* SHA)
+{
+    uint64_t hash = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+        hash = (hash << 8) | SHA[i];
+    }
+    return hash;
+}
+
+/* the hashes of a registered slot are taken from the compact arrays, not from its metadata */
+static uint64_t slot_hash_id(struct pictdb_file const* db_file, uint32_t slot)
+{
+    return db_file->index->id_hashes[slot];
+}
+
+static uint64_t slot_hash_SHA(struct pictdb_file const* db_file, uint32_t slot)
+{
+    return hash_SHA(db_file->index->SHAs[slot]);
+}
+
+/********************************************************************//*
+ * (Re)allocates the per-slot compact arrays for nb_slots entries; the
+ * entries from old_nb_slots on are cleared.
+ */
+static int alloc_slot_arrays(struct pictdb_index* index, uint32_t old_nb_slots, uint32_t nb_slots)
+{
+    const size_t old_words = ((size_t) old_nb_slots + 63) / 64;
+    const size_t words = ((size_t) nb_slots + 63) / 64;
+
+    uint64_t* valid_bits = realloc(index->valid_bits, words * sizeof(uint64_t));
+    if (valid_bits == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->valid_bits = valid_bits;
+    memset(&valid_bits[old_words], 0, (words - old_words) * sizeof(uint64_t));
+
+    uint64_t* id_hashes = realloc(index->id_hashes, ((size_t) nb_slots + 1) * sizeof(uint64_t));
+    if (id_hashes == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->id_hashes = id_hashes;
+
+    unsigned char (*SHAs)[SHA256_DIGEST_LENGTH] = realloc(index->SHAs, ((size_t) nb_slots + 1) * SHA256_DIGEST_LENGTH);
+    if (SHAs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->SHAs = SHAs;
+    return 0;
+}
+
+/********************************************************************//*
+ * Returns the smallest power of two able to hold twice nb_slots entries.
+ */
+static uint32_t index_capacity_for(uint32_t nb_slots)
+{
+    uint32_t capacity = MIN_INDEX_CAPACITY;
+    while (capacity < 2 * (uint64_t) nb_slots) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+/********************************************************************//*
+ * Inserts slot in one of the tables of the index, starting at its hash.
+ */
+static void bucket_add(uint32_t* buckets, uint32_t mask, uint64_t hash, uint32_t slot)
+{
+    uint32_t b = hash & mask;
+    while (buckets[b] != INDEX_EMPTY_BUCKET) {
+        if (buckets[b] == slot + 1) {
+            //already registered
+            return;
+        }
+        b = (b + 1) & mask;
+    }
+    buckets[b] = slot + 1;
+}
+
+/********************************************************************//*
+ * Removes slot from one of the tables of the index.
+ * Uses backward shift deletion so that no tombstone is needed.
+ */
+static void bucket_remove(struct pictdb_file const* db_file, uint32_t* buckets, uint32_t mask,
+                          slot_hash hash_of, uint32_t slot)
+{
+    uint32_t hole = hash_of(db_file, slot) & mask;
+    while (buckets[hole] != slot + 1) {
+        if (buckets[hole] == INDEX_EMPTY_BUCKET) {
+            //the slot was not registered
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    //on ramène vers le trou les entrées dont la position idéale le permet
+    for (uint32_t b = (hole + 1) & mask; buckets[b] != INDEX_EMPTY_BUCKET; b = (b + 1) & mask) {
+        uint32_t ideal = hash_of(db_file, buckets[b] - 1) & mask;
+        if (((b - ideal) & mask) >= ((b - hole) & mask)) {
+            buckets[hole] = buckets[b];
+            hole = b;
+        }
+    }
+    buckets[hole] = INDEX_EMPTY_BUCKET;
+}
+
+/********************************************************************//*
+ * Builds the in-memory index of an opened (or freshly created) pictDB.
+ */
+int build_index(struct pictdb_file* db_file)
+{
+    db_file->index = calloc(1, sizeof(struct pictdb_index));
+    if (db_file->index == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    //metadata supplémentaires (format 1) : le tableau est complété avant de construire les tables
+    int chunks_status = load_metadata_chunks(db_file);
+    if (chunks_status) {
+        free_index(db_file);
+        return chunks_status;
+    }
+    const uint32_t nb_slots = db_file->index->nb_slots;
+
+    db_file->index->capacity = index_capacity_for(nb_slots);
+    db_file->index->id_buckets = calloc(db_file->index->capacity, sizeof(uint32_t));
+    db_file->index->SHA_buckets = calloc(db_file->index->capacity, sizeof(uint32_t));
+    db_file->index->free_slots = calloc(nb_slots + 1, sizeof(uint32_t));
+    db_file->index->blob_capacity = db_file->index->capacity;
+    db_file->index->blobs = calloc(db_file->index->blob_capacity, sizeof(struct blob_count));
+    if (db_file->index->id_buckets == NULL || db_file->index->SHA_buckets == NULL
+        || db_file->index->free_slots == NULL || db_file->index->blobs == NULL
+        || alloc_slot_arrays(db_file->index, 0, nb_slots)) {
+        free_index(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    //empilement des entrées libres de la dernière à la première, pour que les plus basses sortent en premier
+    for (uint32_t i = nb_slots; i > 0; --i) {
+        if (db_file->metadata[i - 1].is_valid == EMPTY) {
+            index_push_free_slot(db_file, i - 1);
+        }
+    }
+
+    for (uint32_t i = 0; i < nb_slots; ++i) {
+        if (db_file->metadata[i].is_valid == NON_EMPTY) {
+            int add_status = index_add_slot(db_file, i);
+            if (!add_status) {
+                add_status = index_ref_slot_blobs(db_file, i);
+            }
+            if (add_status) {
+                free_index(db_file);
+                return add_status;
+            }
+        }
+    }
+
+    //les zones mortes du fichier se déduisent des images vivantes
+    int extents_status = index_build_free_extents(db_file);
+    if (extents_status) {
+        free_index(db_file);
+        return extents_status;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Extends the index to the entries added to the metadata array by do_grow.
+ */
+int index_grow(struct pictdb_file* db_file, uint32_t old_nb_slots)
+{
+    struct pictdb_index* index = db_file->index;
+    const uint32_t nb_slots = index->nb_slots;
+    const uint32_t nb_new = nb_slots - old_nb_slots;
+
+    //les nouvelles entrées sont les plus hautes : elles vont au fond de la pile des entrées libres
+    uint32_t* free_slots = realloc(index->free_slots, ((size_t) nb_slots + 1) * sizeof(uint32_t));
+    if (free_slots == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->free_slots = free_slots;
+    memmove(&free_slots[nb_new], &free_slots[0], index->nb_free * sizeof(uint32_t));
+    for (uint32_t k = 0; k < nb_new; ++k) {
+        free_slots[k] = nb_slots - 1 - k;
+    }
+    index->nb_free += nb_new;
+
+    int arrays_status = alloc_slot_arrays(index, old_nb_slots, nb_slots);
+    if (arrays_status) {
+        return arrays_status;
+    }
+
+    //les tables doivent rester au plus à moitié pleines
+    const uint32_t capacity = index_capacity_for(nb_slots);
+    if (capacity > index->capacity) {
+        uint32_t* id_buckets = calloc(capacity, sizeof(uint32_t));
+        uint32_t* SHA_buckets = calloc(capacity, sizeof(uint32_t));
+        if (id_buckets == NULL || SHA_buckets == NULL) {
+            free(id_buckets);
+            free(SHA_buckets);
+            return ERR_OUT_OF_MEMORY;
+        }
+        free(index->id_buckets);
+        free(index->SHA_buckets);
+        index->id_buckets = id_buckets;
+        index->SHA_buckets = SHA_buckets;
+        index->capacity = capacity;
+        for (uint32_t i = 0; i < old_nb_slots; ++i) {
+            if (index_slot_valid(index, i)) {
+                (void) index_add_slot(db_file, i);
+            }
+        }
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Frees the in-memory index (can safely be called several times).
+ */
+void free_index(struct pictdb_file* db_file)
+{
+    if (db_file->index != NULL) {
+        //the background threads use the index, they are stopped first
+        derive_queue_stop(db_file);
+        journal_close(db_file);
+        if (db_file->index->id_buckets != NULL) {
+            free(db_file->index->id_buckets);
+            db_file->index->id_buckets = NULL;
+        }
+        if (db_file->index->SHA_buckets != NULL) {
+            free(db_file->index->SHA_buckets);
+            db_file->index->SHA_buckets = NULL;
+        }
+        if (db_file->index->free_slots != NULL) {
+            free(db_file->index->free_slots);
+            db_file->index->free_slots = NULL;
+        }
+        if (db_file->index->blobs != NULL) {
+            free(db_file->index->blobs);
+            db_file->index->blobs = NULL;
+        }
+        free(db_file->index->free_extents);
+        free(db_file->index->valid_bits);
+        free(db_file->index->id_hashes);
+        free(db_file->index->SHAs);
+        if (db_file->index->chunks != NULL) {
+            free(db_file->index->chunks);
+            db_file->index->chunks = NULL;
+        }
+        free(db_file->index);
+        db_file->index = NULL;
+    }
+}
+
+/********************************************************************//*
+ * Looks up the metadata slot of a valid picture, -1 if not found.
+ */
+int index_find_id(struct pictdb_file const* db_file, const char* pict_id)
+{
+    const struct pictdb_index* index = db_file->index;
+    const uint32_t mask = index->capacity - 1;
+
+    const uint64_t hash = hash_pict_id(pict_id);
+
+    for (uint32_t b = hash & mask; index->id_buckets[b] != INDEX_EMPTY_BUCKET; b = (b + 1) & mask) {
+        uint32_t slot = index->id_buckets[b] - 1;
+        if (index->paged) {
+            //a table loaded from an index file is only trusted as far as the metadata confirm it
+            if (slot >= index->nb_slots || db_file->metadata[slot].is_valid != NON_EMPTY) {
+                continue;
+            }
+        } else if (index->id_hashes[slot] != hash) {
+            //other id: its metadata entry is not read
+            continue;
+        }
+        if (!strncmp(db_file->metadata[slot].pict_id, pict_id, MAX_PIC_ID + 1)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/********************************************************************//*
+ * Looks up a valid picture (other than excluded_slot) with the given
+ * content, -1 if not found.
+ */
+int index_find_SHA(struct pictdb_file const* db_file, const unsigned char* SHA, int excluded_slot)
+{
+    const struct pictdb_index* index = db_file->index;
+    const uint32_t mask = index->capacity - 1;
+
+    for (uint32_t b = hash_SHA(SHA) & mask; index->SHA_buckets[b] != INDEX_EMPTY_BUCKET; b = (b + 1) & mask) {
+        int slot = index->SHA_buckets[b] - 1;
+        if (slot != excluded_slot && !memcmp(index->SHAs[slot], SHA, SHA256_DIGEST_LENGTH)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/********************************************************************//*
+ * Registers the picture stored at the given slot into the index.
+ */
+int index_add_slot(struct pictdb_file* db_file, uint32_t slot)
+{
+    struct pictdb_index* index = db_file->index;
+    const uint32_t mask = index->capacity - 1;
+
+    //copie des champs utiles aux recherches dans les tableaux compacts
+    index->id_hashes[slot] = hash_pict_id(db_file->metadata[slot].pict_id);
+    memcpy(index->SHAs[slot], db_file->metadata[slot].SHA, SHA256_DIGEST_LENGTH);
+    index->valid_bits[slot / 64] |= UINT64_C(1) << (slot % 64);
+
+    bucket_add(index->id_buckets, mask, slot_hash_id(db_file, slot), slot);
+    bucket_add(index->SHA_buckets, mask, slot_hash_SHA(db_file, slot), slot);
+    return 0;
+}
+
+/********************************************************************//*
+ * Removes the picture stored at the given slot from the index.
+ */
+void index_remove_slot(struct pictdb_file* db_file, uint32_t slot)
+{
+    struct pictdb_index* index = db_file->index;
+    const uint32_t mask = index->capacity - 1;
+
+    if (!index_slot_valid(index, slot)) {
+        //not registered
+        return;
+    }
+    bucket_remove(db_file, index->id_buckets, mask, slot_hash_id, slot);
+    bucket_remove(db_file, index->SHA_buckets, mask, slot_hash_SHA, slot);
+    index->valid_bits[slot / 64] &= ~(UINT64_C(1) << (slot % 64));
+}
+
+/********************************************************************//*
+ * Takes the free slot on top of the stack, -1 if the database is full.
+ */
+int index_pop_free_slot(struct pictdb_file* db_file)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index->nb_free == 0) {
+        return -1;
+    }
+    --index->nb_free;
+    return index->free_slots[index->nb_free];
+}
+
+/********************************************************************//*
+ * Pushes a slot which became EMPTY on the stack of free slots.
+ */
+void index_push_free_slot(struct pictdb_file* db_file, uint32_t slot)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index->nb_free < index->nb_slots) {
+        index->free_slots[index->nb_free] = slot;
+        ++index->nb_free;
+    }
+}
+
+/********************************************************************//*
+ * Returns the bucket of offset in the table of images (or the empty
+ * bucket where it would be added).
+ */
+static uint32_t blob_bucket(const struct blob_count* blobs, uint32_t capacity, uint64_t offset)
+{
+    const uint32_t mask = capacity - 1;
+    uint32_t b = (offset * BLOB_HASH_MULTIPLIER) & mask;
+    while (blobs[b].offset != 0 && blobs[b].offset != offset) {
+        b = (b + 1) & mask;
+    }
+    return b;
+}
+
+/********************************************************************//*
+ * Doubles the capacity of the table of images.
+ */
+static int blob_table_grow(struct pictdb_index* index)
+{
+    const uint32_t capacity = index->blob_capacity * 2;
+    struct blob_count* blobs = calloc(capacity, sizeof(struct blob_count));
+    if (blobs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (uint32_t b = 0; b < index->blob_capacity; ++b) {
+        if (index->blobs[b].offset != 0) {
+            blobs[blob_bucket(blobs, capacity, index->blobs[b].offset)] = index->blobs[b];
+        }
+    }
+    free(index->blobs);
+    index->blobs = blobs;
+    index->blob_capacity = capacity;
+    return 0;
+}
+
+/********************************************************************//*
+ * Removes the entry at bucket hole from the table of images
+ * (backward shift deletion, as for the other tables).
+ */
+static void blob_remove_bucket(struct pictdb_index* index, uint32_t hole)
+{
+    const uint32_t mask = index->blob_capacity - 1;
+    for (uint32_t b = (hole + 1) & mask; index->blobs[b].offset != 0; b = (b + 1) & mask) {
+        uint32_t ideal = (index->blobs[b].offset * BLOB_HASH_MULTIPLIER) & mask;
+        if (((b - ideal) & mask) >= ((b - hole) & mask)) {
+            index->blobs[hole] = index->blobs[b];
+            hole = b;
+        }
+    }
+    index->blobs[hole].offset = 0;
+    index->blobs[hole].size = 0;
+    index->blobs[hole].refcount = 0;
+    index->blobs[hole].pins = 0;
+}
+
+/********************************************************************//*
+ * Frees the area of the image at bucket b, once it has neither
+ * reference nor pin left.
+ */
+static int blob_release(struct pictdb_file* db_file, uint32_t b)
+{
+    struct pictdb_index* index = db_file->index;
+    int free_status = 0;
+    if (index->blobs[b].refcount == 0 && index->blobs[b].pins == 0) {
+        --index->nb_blobs;
+        free_status = index_free_extent(db_file, index->blobs[b].offset, index->blobs[b].size);
+        blob_remove_bucket(index, b);
+    }
+    return free_status;
+}
+
+/********************************************************************//*
+ * Adds a reference to the image stored at offset.
+ */
+int index_ref_blob(struct pictdb_file* db_file, uint64_t offset, uint32_t size)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || offset == 0) {
+        return 0;
+    }
+    //la table reste au plus à moitié pleine
+    if (2 * ((uint64_t) index->nb_blobs + 1) > index->blob_capacity) {
+        int grow_status = blob_table_grow(index);
+        if (grow_status) {
+            return grow_status;
+        }
+    }
+
+    uint32_t b = blob_bucket(index->blobs, index->blob_capacity, offset);
+    if (index->blobs[b].offset == 0) {
+        index->blobs[b].offset = offset;
+        index->blobs[b].size = size;
+        index->blobs[b].refcount = 0;
+        index->blobs[b].pins = 0;
+        ++index->nb_blobs;
+    }
+    //une image épinglée sans référence redevient vivante
+    if (index->blobs[b].refcount++ == 0) {
+        index->live_bytes += index->blobs[b].size;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Removes a reference to the image stored at offset.
+ */
+int index_unref_blob(struct pictdb_file* db_file, uint64_t offset)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || offset == 0) {
+        return 0;
+    }
+    uint32_t b = blob_bucket(index->blobs, index->blob_capacity, offset);
+    if (index->blobs[b].offset == 0) {
+        return 0;
+    }
+    if (index->blobs[b].refcount == 0) {
+        return 0;
+    }
+    if (--index->blobs[b].refcount == 0) {
+        //plus aucune entrée ne référence l'image : ses octets sont morts, et réutilisables une fois désépinglée
+        index->live_bytes -= index->blobs[b].size;
+        return blob_release(db_file, b);
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Pins the image stored at offset while it is read without the lock.
+ */
+int index_pin_blob(struct pictdb_file* db_file, uint64_t offset)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || offset == 0) {
+        return 0;
+    }
+    uint32_t b = blob_bucket(index->blobs, index->blob_capacity, offset);
+    if (index->blobs[b].offset == 0) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    atomic_fetch_add(&index->blobs[b].pins, 1);
+    return 0;
+}
+
+/********************************************************************//*
+ * Unpins an image pinned by index_pin_blob.
+ */
+void index_unpin_blob(struct pictdb_file* db_file, uint64_t offset)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || offset == 0) {
+        return;
+    }
+    uint32_t b = blob_bucket(index->blobs, index->blob_capacity, offset);
+    if (index->blobs[b].offset == 0) {
+        return;
+    }
+    //refcount ne change que sous le verrou exclusif : il peut être lu ici
+    if (atomic_fetch_sub(&index->blobs[b].pins, 1) == 1 && index->blobs[b].refcount == 0) {
+        atomic_fetch_add(&index->nb_unpinned, 1);
+    }
+}
+
+/********************************************************************//*
+ * Frees the dead images whose last pin was dropped under the shared lock.
+ */
+int index_release_unpinned(struct pictdb_file* db_file)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || atomic_load(&index->nb_unpinned) == 0) {
+        return 0;
+    }
+    int status = 0;
+    uint32_t b = 0;
+    while (b < index->blob_capacity) {
+        if (index->blobs[b].offset != 0 && index->blobs[b].refcount == 0 && index->blobs[b].pins == 0) {
+            //la suppression décale les entrées suivantes : le même bucket est revu
+            int release_status = blob_release(db_file, b);
+            if (!status) {
+                status = release_status;
+            }
+        } else {
+            ++b;
+        }
+    }
+    atomic_store(&index->nb_unpinned, 0);
+    return status;
+}
+
+/********************************************************************//*
+ * Adds a reference to every image of a metadata entry.
+ */
+int index_ref_slot_blobs(struct pictdb_file* db_file, uint32_t slot)
+{
+    const struct pict_metadata* metadata = &db_file->metadata[slot];
+    for (int res = 0; res < NB_RES; ++res) {
+        if (metadata->size[res] != 0) {
+            int ref_status = index_ref_blob(db_file, metadata->offset[res], metadata->size[res]);
+            if (ref_status) {
+                return ref_status;
+            }
+        }
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Removes a reference to every image of a metadata entry.
+ */
+int index_unref_slot_blobs(struct pictdb_file* db_file, uint32_t slot)
+{
+    const struct pict_metadata* metadata = &db_file->metadata[slot];
+    int status = 0;
+    //toutes les références sont retirées, même après une erreur
+    for (int res = 0; res < NB_RES; ++res) {
+        if (metadata->size[res] != 0) {
+            int unref_status = index_unref_blob(db_file, metadata->offset[res]);
+            if (!status) {
+                status = unref_status;
+            }
+        }
+    }
+    return status;
+}
+
+/********************************************************************//*
+ * Orders the free extents (or the live areas) by offset.
+ */
+static int compare_extents(const void* a, const void* b)
+{
+    const struct free_extent* extent_a = a;
+    const struct free_extent* extent_b = b;
+    if (extent_a->offset != extent_b->offset) {
+        return extent_a->offset < extent_b->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Computes the free extents from the live images, the chunks and the file size.
+ */
+int index_build_free_extents(struct pictdb_file* db_file)
+{
+    struct pictdb_index* index = db_file->index;
+    int release_status = index_release_unpinned(db_file);
+    if (release_status) {
+        return release_status;
+    }
+    index->nb_free_extents = 0;
+
+    //la taille du fichier doit tenir compte des écritures en attente
+    struct stat file_stat;
+    if (fflush(db_file->fpdb) != 0 || fstat(fileno(db_file->fpdb), &file_stat) != 0) {
+        return ERR_IO;
+    }
+    const uint64_t file_size = file_stat.st_size;
+
+    //zones vivantes : les images référencées et les blocs de metadata
+    const size_t nb_live = (size_t) index->nb_blobs + index->nb_chunks;
+    struct free_extent* live = calloc(nb_live + 1, sizeof(struct free_extent));
+    if (live == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb = 0;
+    for (uint32_t b = 0; b < index->blob_capacity && nb < index->nb_blobs; ++b) {
+        if (index->blobs[b].offset != 0) {
+            live[nb].offset = index->blobs[b].offset;
+            live[nb].length = index->blobs[b].size;
+            ++nb;
+        }
+    }
+    for (uint32_t c = 0; c < index->nb_chunks; ++c) {
+        live[nb].offset = index->chunks[c].position;
+        live[nb].length = sizeof(struct metadata_chunk_header)
+                          + (uint64_t) index->chunks[c].nb_slots * sizeof(struct pict_metadata);
+        ++nb;
+    }
+    qsort(live, nb, sizeof(struct free_extent), compare_extents);
+
+    uint64_t cursor = sizeof(struct pictdb_header) + (uint64_t) db_file->header.max_files * sizeof(struct pict_metadata);
+    for (size_t k = 0; k <= nb; ++k) {
+        const uint64_t next = k < nb ? live[k].offset : file_size;
+        if (next > cursor) {
+            int free_status = index_free_extent(db_file, cursor, next - cursor);
+            if (free_status) {
+                free(live);
+                return free_status;
+            }
+        }
+        if (k < nb && live[k].offset + live[k].length > cursor) {
+            cursor = live[k].offset + live[k].length;
+        }
+    }
+
+    free(live);
+    return 0;
+}
+
+/********************************************************************//*
+ * Takes the smallest free extent able to hold size bytes (offset 0 if none).
+ */
+int index_alloc_extent(struct pictdb_file* db_file, uint64_t size, uint64_t* offset)
+{
+    struct pictdb_index* index = db_file->index;
+    *offset = 0;
+    if (index == NULL || size == 0) {
+        return 0;
+    }
+    int release_status = index_release_unpinned(db_file);
+    if (release_status) {
+        return release_status;
+    }
+    uint32_t best = index->nb_free_extents;
+    for (uint32_t e = 0; e < index->nb_free_extents; ++e) {
+        const uint64_t length = index->free_extents[e].length;
+        if (length >= size && (best == index->nb_free_extents || length < index->free_extents[best].length)) {
+            best = e;
+            if (length == size) {
+                break;
+            }
+        }
+    }
+    if (best == index->nb_free_extents) {
+        return 0;
+    }
+
+    //l'image est placée au début de l'extent, le reste reste libre
+    struct free_extent* extent = &index->free_extents[best];
+    *offset = extent->offset;
+    extent->offset += size;
+    extent->length -= size;
+    if (extent->length == 0) {
+        memmove(extent, extent + 1, (index->nb_free_extents - best - 1) * sizeof(struct free_extent));
+        --index->nb_free_extents;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Gives back an area of the file, merged with its free neighbours.
+ */
+int index_free_extent(struct pictdb_file* db_file, uint64_t offset, uint64_t length)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || offset == 0 || length == 0) {
+        return 0;
+    }
+
+    //position d'insertion (premier extent placé après offset)
+    uint32_t e = 0;
+    while (e < index->nb_free_extents && index->free_extents[e].offset < offset) {
+        ++e;
+    }
+    const int merge_previous = e > 0
+                               && index->free_extents[e - 1].offset + index->free_extents[e - 1].length == offset;
+    const int merge_next = e < index->nb_free_extents && offset + length == index->free_extents[e].offset;
+
+    if (merge_previous && merge_next) {
+        index->free_extents[e - 1].length += length + index->free_extents[e].length;
+        memmove(&index->free_extents[e], &index->free_extents[e + 1],
+                (index->nb_free_extents - e - 1) * sizeof(struct free_extent));
+        --index->nb_free_extents;
+    } else if (merge_previous) {
+        index->free_extents[e - 1].length += length;
+    } else if (merge_next) {
+        index->free_extents[e].offset = offset;
+        index->free_extents[e].length += length;
+    } else {
+        if (index->nb_free_extents == index->free_extent_capacity) {
+            const uint32_t capacity = index->free_extent_capacity ? 2 * index->free_extent_capacity : MIN_INDEX_CAPACITY;
+            struct free_extent* extents = realloc(index->free_extents, capacity * sizeof(struct free_extent));
+            if (extents == NULL) {
+                //la zone ne sera réutilisée qu'après la prochaine ouverture (ou un gc)
+                return ERR_OUT_OF_MEMORY;
+            }
+            index->free_extents = extents;
+            index->free_extent_capacity = capacity;
+        }
+        memmove(&index->free_extents[e + 1], &index->free_extents[e],
+                (index->nb_free_extents - e) * sizeof(struct free_extent));
+        index->free_extents[e].offset = offset;
+        index->free_extents[e].length = length;
+        ++index->nb_free_extents;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Records that an image was moved (by compaction), keeping its references.
+ */
+int index_move_blob(struct pictdb_file* db_file, uint64_t old_offset, uint64_t new_offset)
+{
+    struct pictdb_index* index = db_file->index;
+    if (index == NULL || old_offset == 0 || new_offset == 0 || old_offset == new_offset) {
+        return 0;
+    }
+    uint32_t b = blob_bucket(index->blobs, index->blob_capacity, old_offset);
+    if (index->blobs[b].offset == 0) {
+        return 0;
+    }
+    struct blob_count moved = index->blobs[b];
+    --index->nb_blobs;
+    index->live_bytes -= moved.size;
+    blob_remove_bucket(index, b);
+
+    int ref_status = index_ref_blob(db_file, new_offset, moved.size);
+    if (ref_status) {
+        return ref_status;
+    }
+    b = blob_bucket(index->blobs, index->blob_capacity, new_offset);
+    index->blobs[b].refcount += moved.refcount - 1;
+    return 0;
+}
+
+/********************************************************************//*
+ * Prints the occupancy of the metadata slots.
+ */
+void print_occupancy(struct pictdb_file const* db_file)
+{
+    if (db_file->index == NULL || db_file->index->paged) {
+        return;
+    }
+    const uint32_t max_files = db_capacity(db_file);
+    const uint32_t used = max_files - db_file->index->nb_free;
+    printf("FREE SLOTS: %" PRIu32 "\tUSED SLOTS: %" PRIu32 "\tOCCUPANCY: %.1f%%\n",
+           db_file->index->nb_free, used, max_files ? 100.0 * used / max_files : 0.0);
+}
+
+/********************************************************************//*
+ * Returns the name of the index file of a database (to be freed by the caller).
+ */
+static char* index_file_name(const char* file_name, const char* suffix)
+{
+    const size_t length = strlen(file_name) + strlen(INDEX_FILE_EXTENSION) + strlen(suffix) + 1;
+    char* name = malloc(length);
+    if (name != NULL) {
+        snprintf(name, length, "%s%s%s", file_name, INDEX_FILE_EXTENSION, suffix);
+    }
+    return name;
+}
+
+/********************************************************************//*
+ * Saves the id table to the index file of the database.
+ */
+int index_save(struct pictdb_file const* db_file, const char* file_name)
+{
+    const struct pictdb_index* index = db_file->index;
+    if (index == NULL || index->paged || file_name == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (index->nb_chunks > 0) {
+        //do_open_paged ne lit que le tableau suivant le header
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char* tmp_name = index_file_name(file_name, ".tmp");
+    char* final_name = index_file_name(file_name, "");
+    if (tmp_name == NULL || final_name == NULL) {
+        free(tmp_name);
+        free(final_name);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    struct index_file_header file_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, INDEX_FILE_MAGIC, sizeof(file_header.magic));
+    file_header.db_version = db_file->header.db_version;
+    file_header.max_files = db_file->header.max_files;
+    file_header.num_files = db_file->header.num_files;
+    file_header.capacity = index->capacity;
+
+    int status = 0;
+    FILE* index_file = fopen(tmp_name, "wb");
+    if (index_file == NULL) {
+        status = ERR_IO;
+    } else {
+        if (fwrite(&file_header, sizeof(file_header), 1, index_file) != 1
+            || fwrite(index->id_buckets, sizeof(uint32_t), index->capacity, index_file) != index->capacity) {
+            status = ERR_IO;
+        }
+        if (fclose(index_file) != 0) {
+            status = ERR_IO;
+        }
+    }
+    //le fichier n'est visible sous son nom qu'une fois complet
+    if (!status && rename(tmp_name, final_name) != 0) {
+        status = ERR_IO;
+    }
+    if (status) {
+        remove(tmp_name);
+    }
+
+    free(tmp_name);
+    free(final_name);
+    return status;
+}
+
+/********************************************************************//*
+ * Builds a paged index (id table only) from the index file of the database.
+ */
+int index_load(struct pictdb_file* db_file, const char* file_name)
+{
+    char* name = index_file_name(file_name, "");
+    if (name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    FILE* index_file = fopen(name, "rb");
+    free(name);
+    if (index_file == NULL) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    //le fichier d'index n'est valable que pour la version de la base qui l'a écrit
+    struct index_file_header file_header;
+    if (fread(&file_header, sizeof(file_header), 1, index_file) != 1
+        || memcmp(file_header.magic, INDEX_FILE_MAGIC, sizeof(file_header.magic)) != 0
+        || file_header.db_version != db_file->header.db_version
+        || file_header.max_files != db_file->header.max_files
+        || file_header.num_files != db_file->header.num_files
+        || file_header.capacity != index_capacity_for(file_header.max_files)) {
+        fclose(index_file);
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    db_file->index = calloc(1, sizeof(struct pictdb_index));
+    if (db_file->index == NULL) {
+        fclose(index_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    db_file->index->paged = 1;
+    db_file->index->nb_slots = db_file->header.max_files;
+    db_file->index->capacity = file_header.capacity;
+    db_file->index->id_buckets = malloc((size_t) file_header.capacity * sizeof(uint32_t));
+    if (db_file->index->id_buckets == NULL) {
+        fclose(index_file);
+        free_index(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (fread(db_file->index->id_buckets, sizeof(uint32_t), file_header.capacity, index_file) != file_header.capacity) {
+        fclose(index_file);
+        free_index(db_file);
+        return ERR_FILE_NOT_FOUND;
+    }
+    fclose(index_file);
+    return 0;
+}
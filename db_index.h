@@ -0,0 +1,360 @@
+/**
+ * @file db_index.h
+ * @brief Header file for the in-memory index of a pictDB.
+ *
+ * The index is made of two open-addressing hash tables (linear probing)
+ * mapping each valid pict_id, resp. each valid SHA, to its slot in the
+ * metadata array. It is rebuilt from the metadata every time a database
+ * is opened and kept up to date by do_insert and do_delete, so that
+ * lookups and deduplication do not depend on max_files.
+ *
+ * It also holds the stack of free metadata slots, so that do_insert
+ * finds an EMPTY entry in constant time, the read-only mapping of the
+ * file when the database was opened with do_open_paged, the queue of
+ * reduced images to generate in the background (see derive_queue.h), the
+ * write-ahead journal (see db_journal.h) and the reference count of every
+ * image stored in the file: an image shared by deduplicated pictures is
+ * only dead once all of them are deleted. The dead areas of the file are
+ * kept in a list of free extents, where new images are placed (best fit)
+ * instead of being appended.
+ *
+ * The id table can also be saved next to the database (index file, see
+ * index_save), so that a read-only open (do_open_paged) can look up a
+ * picture without reading the whole metadata array.
+ *
+ * The fields read by the lookups are also kept per slot in compact
+ * arrays (validity bitmap, pict_id hashes and SHA): probing a table or
+ * scanning the valid slots does not touch the (large) metadata entries.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#ifndef PICTDBPRJ_DB_INDEX_H
+#define PICTDBPRJ_DB_INDEX_H
+
+#include "pictDB.h"
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+struct derive_queue;
+struct db_journal;
+
+/* Value of an unused bucket (buckets store slot + 1). */
+#define INDEX_EMPTY_BUCKET 0
+
+#define INDEX_FILE_EXTENSION ".idx" // appended to the name of the database file
+#define INDEX_FILE_MAGIC "PDBIDX1" // 7 characters + '\0'
+
+/*! \struct index_file_header
+    \brief Header of an index file, followed by the capacity buckets of the id table.
+
+ The index file is only used if db_version, max_files and num_files
+ are still those of the database header.
+*/
+struct index_file_header {
+    char magic[8]; // INDEX_FILE_MAGIC
+    uint32_t db_version;
+    uint32_t max_files;
+    uint32_t num_files;
+    uint32_t capacity;
+};
+
+/*! \struct metadata_chunk
+    \brief Location of a chunk of metadata (format 1) in the file and in the metadata array.
+*/
+struct metadata_chunk {
+    uint64_t position; // of its metadata_chunk_header in the file
+    uint32_t first_slot;
+    uint32_t nb_slots;
+};
+
+/*! \struct blob_count
+    \brief Number of metadata entries referencing an image stored in the file.
+*/
+struct blob_count {
+    uint64_t offset; // position of the image in the file, 0 for an unused bucket
+    uint32_t size;
+    uint32_t refcount;
+    _Atomic uint32_t pins; // sends in progress (updated under the shared lock): the area is not reused, nor moved, before they end
+};
+
+/*! \struct free_extent
+    \brief A dead area of the file, between (or after) the live images.
+*/
+struct free_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/*! \struct pictdb_index
+    \brief In-memory lookup structures of an opened pictDB.
+
+ The table capacity is always a power of two, at least twice the number
+ of metadata slots, so that probing sequences stay short.
+*/
+struct pictdb_index {
+    uint32_t nb_slots; // entries of the metadata array (see db_capacity)
+    struct metadata_chunk* chunks; // NULL if the metadata are only the array following the header
+    uint32_t nb_chunks;
+    int owns_metadata; // memory-mapped mode: the metadata were copied out of the mapping
+    uint32_t capacity;
+    int paged; // only id_buckets is loaded (do_open_paged): lookups by id only
+    uint32_t* id_buckets; // slot + 1 of the picture, or INDEX_EMPTY_BUCKET
+    uint32_t* SHA_buckets; // idem, keyed by content (shared SHA are all stored)
+    uint64_t* valid_bits; // bit slot set iff the slot is registered (NULL if paged)
+    uint64_t* id_hashes; // hash_pict_id of each registered slot (NULL if paged)
+    unsigned char (*SHAs)[SHA256_DIGEST_LENGTH]; // SHA of each registered slot (NULL if paged)
+    uint32_t* free_slots; // stack of EMPTY slots, lowest slot on top
+    uint32_t nb_free;
+    const char* mapping; // whole file, only in memory-mapped mode (NULL otherwise)
+    size_t mapping_size;
+    struct derive_queue* derive_queue; // NULL if the reduced images are only made by do_read
+    struct db_journal* journal; // NULL if the updates are not journaled (see db_journal.h)
+    struct blob_count* blobs; // open-addressing table keyed by offset (power of two capacity)
+    uint32_t blob_capacity;
+    uint32_t nb_blobs;
+    uint64_t live_bytes; // total size of the images referenced at least once
+    _Atomic uint32_t nb_unpinned; // dead images unpinned under the shared lock, freed by index_release_unpinned
+    struct free_extent* free_extents; // sorted by offset, never adjacent
+    uint32_t nb_free_extents;
+    uint32_t free_extent_capacity;
+};
+
+/**
+ * @brief Hashes a picture id (64 bits FNV-1a).
+ *
+ * @param pict_id the '\0'-terminated picture id.
+ * @return the hash value of pict_id.
+ */
+uint64_t hash_pict_id(const char* pict_id);
+
+/**
+ * @brief Hashes a SHA-256 value.
+ *
+ * @param SHA the SHA256_DIGEST_LENGTH bytes of the digest.
+ * @return the hash value of SHA.
+ */
+uint64_t hash_SHA(const unsigned char* SHA);
+
+/**
+ * @brief Looks up the metadata slot of a valid picture.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param pict_id the id of the picture to find.
+ * @return the index of the picture in the metadata array, -1 if not found.
+ */
+int index_find_id(struct pictdb_file const* db_file, const char* pict_id);
+
+/**
+ * @brief Looks up a valid picture with the given content.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param SHA the SHA-256 of the content to find.
+ * @param excluded_slot slot to ignore (typically the picture being inserted), -1 for none.
+ * @return the index of such a picture in the metadata array, -1 if not found.
+ */
+int index_find_SHA(struct pictdb_file const* db_file, const unsigned char* SHA, int excluded_slot);
+
+/**
+ * @brief Tells whether a slot holds a valid picture registered in a complete
+ *        (not paged) index, without reading its metadata entry.
+ *
+ * @param index the index of an opened database.
+ * @param slot the index of the entry in the metadata array.
+ * @return 1 if the slot is registered, 0 otherwise.
+ */
+static inline int index_slot_valid(struct pictdb_index const* index, uint32_t slot)
+{
+    return (index->valid_bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+/**
+ * @brief Registers the picture stored at the given slot into the index.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param slot the index of the (valid) picture in the metadata array.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_add_slot(struct pictdb_file* db_file, uint32_t slot);
+
+/**
+ * @brief Removes the picture stored at the given slot from the index.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param slot the index of the picture in the metadata array.
+ */
+void index_remove_slot(struct pictdb_file* db_file, uint32_t slot);
+
+/**
+ * @brief Takes a free (EMPTY) slot of the metadata array.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @return the lowest free slot, -1 if the database is full.
+ */
+int index_pop_free_slot(struct pictdb_file* db_file);
+
+/**
+ * @brief Gives back a slot of the metadata array which became EMPTY.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param slot the index of the freed entry in the metadata array.
+ */
+void index_push_free_slot(struct pictdb_file* db_file, uint32_t slot);
+
+/**
+ * @brief Loads the metadata chunks of a format 1 database: the metadata array
+ *        is extended with their entries and their location is recorded.
+ *        Called by build_index before the tables are built.
+ *
+ * @param db_file In memory structure with header, metadata and (empty) index.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int load_metadata_chunks(struct pictdb_file* db_file);
+
+/**
+ * @brief Extends the index after nb_slots - old_nb_slots entries were added
+ *        to the metadata array (do_grow): the new entries become free slots.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param old_nb_slots the previous number of entries.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_grow(struct pictdb_file* db_file, uint32_t old_nb_slots);
+
+/**
+ * @brief Saves the id table of a complete index (not paged) to the index file
+ *        of the database (file_name followed by INDEX_FILE_EXTENSION).
+ *        The file is written aside and then renamed, so that it is never partial.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param file_name the name of the database file.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_save(struct pictdb_file const* db_file, const char* file_name);
+
+/**
+ * @brief Builds a paged index (id table only) from the index file of the
+ *        database, without reading the metadata.
+ *
+ * @param db_file In memory structure with header and metadata (not read yet).
+ * @param file_name the name of the database file.
+ * @return ERR_FILE_NOT_FOUND if there is no up-to-date index file,
+ *         another error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_load(struct pictdb_file* db_file, const char* file_name);
+
+/**
+ * @brief Adds a reference to the image stored at offset.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param offset the position of the image in the file (0: nothing is done).
+ * @param size the size of the image.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_ref_blob(struct pictdb_file* db_file, uint64_t offset, uint32_t size);
+
+/**
+ * @brief Removes a reference to the image stored at offset (the image is
+ *        dead, i.e. reclaimable by gc, once it has no reference left).
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param offset the position of the image in the file (0: nothing is done).
+ * @return ERR_OUT_OF_MEMORY if the area of a dead image could not be recorded
+ *         as free (it is only found again at the next opening), 0 otherwise.
+ */
+int index_unref_blob(struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief Pins the image stored at offset while it is read without the
+ *        database lock (e.g. sent to a client): until index_unpin_blob,
+ *        its area is neither reused nor moved, even if it loses its last
+ *        reference in the meantime. The count of pins is atomic: a shared
+ *        lock on the database is enough.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param offset the position of the image in the file.
+ * @return ERR_FILE_NOT_FOUND if no image is stored at offset, 0 otherwise.
+ */
+int index_pin_blob(struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief Unpins an image pinned by index_pin_blob. A shared lock on the
+ *        database is enough: if it was the last pin of an image without
+ *        reference, its area is only freed by the next writer, with
+ *        index_release_unpinned.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param offset the position of the image in the file.
+ */
+void index_unpin_blob(struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief Frees the areas of the dead images whose last pin was dropped
+ *        since the previous call. Called by index_alloc_extent,
+ *        index_build_free_extents and do_compact_step, i.e. by the writers,
+ *        before they look for free areas.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_release_unpinned(struct pictdb_file* db_file);
+
+/**
+ * @brief Adds (resp. removes) a reference to every image of a metadata entry.
+ *        All the references are removed even if an error occurs.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param slot the index of the picture in the metadata array.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_ref_slot_blobs(struct pictdb_file* db_file, uint32_t slot);
+int index_unref_slot_blobs(struct pictdb_file* db_file, uint32_t slot);
+
+/**
+ * @brief Computes the free extents of the file from the live images (and
+ *        the metadata chunks): every area after the metadata array which
+ *        is not referenced, up to the end of the file, is free.
+ *        Called by build_index and after each compaction step.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_build_free_extents(struct pictdb_file* db_file);
+
+/**
+ * @brief Takes the smallest free extent able to hold size bytes (best fit).
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param size the size of the image to store.
+ * @param offset where the offset at which the image can be written is stored,
+ *        0 if it has to be appended at the end of the file.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_alloc_extent(struct pictdb_file* db_file, uint64_t size, uint64_t* offset);
+
+/**
+ * @brief Gives back an area of the file (merged with the adjacent free extents).
+ *        Called by index_unref_blob when an image loses its last reference.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param offset the position of the area.
+ * @param length the size of the area.
+ * @return ERR_OUT_OF_MEMORY if the array of free extents could not grow (the
+ *         area is then only found again at the next opening), 0 otherwise.
+ */
+int index_free_extent(struct pictdb_file* db_file, uint64_t offset, uint64_t length);
+
+/**
+ * @brief Records that the image stored at old_offset was moved to new_offset
+ *        (its references are kept).
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param old_offset the previous position of the image.
+ * @param new_offset the new position of the image.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int index_move_blob(struct pictdb_file* db_file, uint64_t old_offset, uint64_t new_offset);
+
+#endif
@@ -7,11 +7,17 @@
  * @date Apr 2016
  */
 
+#define _POSIX_C_SOURCE 200809L // for pthread_rwlock_t with -std=c99
+
 #include "pictDB.h"
 #include "error.h"
 #include "dedup.h" //for do_name_and_content_dedup
 #include "image_content.h" //for get_resolution
+#include "db_index.h" //for index_add_slot, the free slots stack and the free extents
+#include "derive_queue.h" //for derive_queue_push
+#include "db_journal.h" //for journal_commit and journal_checkpoint
 
+#include <pthread.h> // for the probing threads of do_insert_batch_parallel
 #include <stdint.h> // for uint32_t, uint64_t
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,115 +25,523 @@
 #include <openssl/sha.h> // for SHA
 
 /********************************************************************//*
- * Function used to insert an image in the database
+ * Calcule le SHA et la résolution d'une image à insérer et, en mode eager
+ * (item->eager ou PICTDB_FLAG_EAGER_RESIZE dans header), crée ses images
+ * réduites à partir de ce même passage. Ne touche pas à la base de
+ * données : peut être appelée par plusieurs threads à la fois.
  */
-int do_insert(const char* const image, size_t image_size, char* pict_id, struct pictdb_file* db_file)
+static int probe_item(struct insert_item* item, struct pictdb_header const* header)
 {
-    /* ====== recherche d'une position libre dans l'index ====== */
+    item->reduced[RES_THUMB] = item->reduced[RES_SMALL] = NULL;
+    item->reduced_sizes[RES_THUMB] = item->reduced_sizes[RES_SMALL] = 0;
 
-    //si le nombre actuel d'images dans la base de donnée n'est pas inférieur à max_files
-    if (!(db_file->header.num_files < db_file->header.max_files)) {
-        return ERR_FULL_DATABASE;
+    //on teste s'il y a un overflow (lors du stockage d'une valeur de type size_t dans un uint32_t)
+    if (item->image_size > UINT32_MAX) {
+        return ERR_RESOLUTIONS;
     }
 
-    //recherche d'une entrée vide dans la metadata
-    int found = 0;
-    int i = 0;
-    while(!found) {
-        if (db_file->metadata[i].is_valid == EMPTY) {
-            //placement de la valeur hash SHA256 de l’image dans le champ SHA
-            unsigned char sha[SHA256_DIGEST_LENGTH];
-            (void)SHA256((unsigned char *)image, image_size, sha);
+    //valeur hash SHA256 de l’image
+    (void)SHA256((const unsigned char *)item->image, item->image_size, item->SHA);
 
-            for(int j = 0; j < SHA256_DIGEST_LENGTH; ++j) {
-                db_file->metadata[i].SHA[j] = sha[j];
-            }
+    //détermination de la largeur et de la hauteur de l'image
+    int res_status = get_resolution(&(item->res_orig[1]), &(item->res_orig[0]), item->image, item->image_size);
+    if (res_status || !(item->eager || (header->unused_32 & PICTDB_FLAG_EAGER_RESIZE))) {
+        return res_status;
+    }
 
-            //copie de la chaîne de caractères pict_id dans le champs correspondant
-            strncpy(db_file->metadata[i].pict_id, pict_id, MAX_PIC_ID+1);
+    /*en cas d'échec, l'image est tout de même insérée : ses images réduites
+    seront créées plus tard (file de dérivation ou do_read)*/
+    const int needed[RES_ORIG] = {1, 1};
+    (void) create_reduced_images(item->image, item->image_size, header, needed, item->reduced, item->reduced_sizes);
+    return 0;
+}
 
-            //stockage de la taille de l’image (passée en paramètre) dans le champs RES_ORIG
-            if (image_size > UINT32_MAX) {
-                /*on teste s'il y a un overflow (lors du stockage d'une valeur de type size_t
-                dans un uint32_t) et on renvoie une erreur le cas échéant*/
-                return ERR_RESOLUTIONS;
-            }
-            db_file->metadata[i].size[RES_ORIG] = image_size;
-            db_file->metadata[i].is_valid = NON_EMPTY;
-            //pour s'assurer que do_read detectera l'absence de thumb/small même si une image fut dans cette métadata précdemment
-            db_file->metadata[i].offset[RES_THUMB] = 0;
-            db_file->metadata[i].offset[RES_SMALL] = 0;
-
-            found = 1;
-        } else {
-            ++i;
+/********************************************************************//*
+ * Libère les images réduites créées par probe_item.
+ */
+static void release_reduced(struct insert_item* item)
+{
+    free_the_buffer(&item->reduced[RES_THUMB]);
+    free_the_buffer(&item->reduced[RES_SMALL]);
+    item->reduced_sizes[RES_THUMB] = item->reduced_sizes[RES_SMALL] = 0;
+}
+
+/********************************************************************//*
+ * Écrit une image dans la place libre la plus ajustée ou, à défaut, à la
+ * position end_of_file (avancée d'autant). fpdb est laissé à end_of_file.
+ */
+static int write_blob(struct pictdb_file* db_file, const char* data, size_t size,
+                      uint64_t* end_of_file, uint64_t* offset)
+{
+    uint64_t hole = 0;
+    int alloc_status = index_alloc_extent(db_file, size, &hole);
+    if (alloc_status) {
+        return alloc_status;
+    }
+    int write_ok = hole == 0 || fseek(db_file->fpdb, hole, SEEK_SET) == 0;
+    write_ok = write_ok && fwrite(data, sizeof(char), size, db_file->fpdb) == size;
+    //retour à la fin du fichier, où les images suivantes du lot sont ajoutées
+    write_ok = write_ok && (hole == 0 || fseek(db_file->fpdb, *end_of_file, SEEK_SET) == 0);
+    if (!write_ok) {
+        //l'erreur d'écriture prime : une place qui n'a pu être rendue est retrouvée à la prochaine ouverture
+        index_free_extent(db_file, hole, size);
+        return ERR_IO;
+    }
+    *offset = hole != 0 ? hole : *end_of_file;
+    if (hole == 0) {
+        *end_of_file += size;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Ajoute un bloc d'entrées à une base pleine (format 1 uniquement), puis
+ * repositionne fpdb à la nouvelle fin du fichier.
+ */
+static int make_room(struct pictdb_file* db_file, uint64_t* end_of_file)
+{
+    //le bloc ajouté double le nombre d'entrées, dans les limites de METADATA_CHUNK_MIN/MAX
+    uint32_t nb_slots = db_capacity(db_file);
+    if (nb_slots < METADATA_CHUNK_MIN) {
+        nb_slots = METADATA_CHUNK_MIN;
+    }
+    if (nb_slots > METADATA_CHUNK_MAX) {
+        nb_slots = METADATA_CHUNK_MAX;
+    }
+    if ((uint64_t) db_capacity(db_file) + nb_slots > MAX_TOTAL_FILES) {
+        nb_slots = MAX_TOTAL_FILES - db_capacity(db_file);
+    }
+    if (nb_slots == 0) {
+        return ERR_FULL_DATABASE;
+    }
+
+    int grow_status = do_grow(db_file, nb_slots);
+    if (grow_status) {
+        return grow_status;
+    }
+    //le bloc a été écrit à la fin du fichier : les images suivantes vont après lui
+    if (fseek(db_file->fpdb, 0, SEEK_END) != 0) {
+        return ERR_IO;
+    }
+    long end = ftell(db_file->fpdb);
+    if (end < 0) {
+        return ERR_IO;
+    }
+    *end_of_file = end;
+    return 0;
+}
+
+/********************************************************************//*
+ * Insère une image déjà analysée (probe_item) dans les structures en
+ * mémoire (metadata et index) et écrit son contenu, s'il n'a pas de
+ * doublon, dans la place libre la plus ajustée ou, à défaut, à la position
+ * end_of_file, où fpdb doit déjà être positionné (et où il est laissé).
+ * La metadata et le header ne sont pas écrits sur le disque : c'est à
+ * l'appelant de le faire.
+ */
+static int insert_in_memory(struct insert_item* item, struct pictdb_file* db_file, uint64_t* end_of_file)
+{
+    /* ====== recherche d'une position libre dans l'index ====== */
+
+    //si le nombre actuel d'images dans la base de donnée n'est pas inférieur au nombre d'entrées
+    if (!(db_file->header.num_files < db_capacity(db_file))) {
+        int grow_status = make_room(db_file, end_of_file);
+        if (grow_status) {
+            return grow_status;
         }
     }
 
+    //recherche d'une entrée vide dans la metadata (sommet de la pile des entrées libres)
+    int i = index_pop_free_slot(db_file);
+    if (i < 0) {
+        return ERR_FULL_DATABASE;
+    }
+
+    //placement de la valeur hash SHA256 de l’image dans le champ SHA
+    memcpy(db_file->metadata[i].SHA, item->SHA, SHA256_DIGEST_LENGTH);
+
+    //copie de la chaîne de caractères pict_id dans le champs correspondant
+    strncpy(db_file->metadata[i].pict_id, item->pict_id, MAX_PIC_ID+1);
+
+    //stockage de la taille et de la résolution de l’image
+    db_file->metadata[i].size[RES_ORIG] = item->image_size;
+    db_file->metadata[i].res_orig[0] = item->res_orig[0];
+    db_file->metadata[i].res_orig[1] = item->res_orig[1];
+    db_file->metadata[i].is_valid = NON_EMPTY;
+    //pour s'assurer que do_read detectera l'absence de thumb/small même si une image fut dans cette métadata précdemment
+    db_file->metadata[i].offset[RES_THUMB] = 0;
+    db_file->metadata[i].offset[RES_SMALL] = 0;
+    db_file->metadata[i].size[RES_THUMB] = 0;
+    db_file->metadata[i].size[RES_SMALL] = 0;
+
     /* ====== déduplication de l'image ====== */
     int dedup_status = do_name_and_content_dedup(db_file, i);
     if(dedup_status) {
+        //l'entrée réservée est libérée pour ne pas laisser d'image fantôme en mémoire
+        db_file->metadata[i].is_valid = EMPTY;
+        index_push_free_slot(db_file, i);
         return dedup_status;
     }
 
+    //enregistrement de l'image dans l'index en mémoire
+    int index_status = index_add_slot(db_file, i);
+    if(index_status) {
+        db_file->metadata[i].is_valid = EMPTY;
+        index_push_free_slot(db_file, i);
+        return index_status;
+    }
+
     /* ====== écriture de l'image sur le disque ====== */
 
-    //si l'image à la position i n'a pas de doublon, écriture de son contenu à la fin du fichier
+    //si l'image à la position i n'a pas de doublon, écriture de son contenu dans une place libre ou à la fin du fichier
+    uint64_t written[NB_RES] = {0, 0, 0}; // offsets des images écrites ici (et non partagées avec un doublon)
+    int write_status = 0;
     if (db_file->metadata[i].offset[RES_ORIG] == 0) {
-
-        int fseek_status = fseek(db_file->fpdb, 0, SEEK_END);
-        if (fseek_status != 0) {
-            return ERR_IO;
-        }
-
-        //enregistrement de l'offset (fin du fichier) dans la metadata
-        db_file->metadata[i].offset[RES_ORIG] = ftell(db_file->fpdb);
-
-        int write_status = fwrite(image, sizeof(char), image_size, db_file->fpdb);
-        if (write_status != image_size) {
-            return ERR_IO;
+        write_status = write_blob(db_file, item->image, item->image_size, end_of_file, &written[RES_ORIG]);
+        db_file->metadata[i].offset[RES_ORIG] = written[RES_ORIG];
+    }
+    //images réduites créées à l'analyse (mode eager), sauf si le doublon en a déjà
+    for (int res = RES_THUMB; res < RES_ORIG && !write_status; ++res) {
+        if (item->reduced[res] != NULL && db_file->metadata[i].offset[res] == 0) {
+            write_status = write_blob(db_file, item->reduced[res], item->reduced_sizes[res], end_of_file, &written[res]);
+            db_file->metadata[i].offset[res] = written[res];
+            db_file->metadata[i].size[res] = written[res] != 0 ? item->reduced_sizes[res] : 0;
         }
     }
 
-    /* ====== mise à jour des données de la base d'images ====== */
-
-    //détermination de la largeur et de la hauteur de l'image
-    int get_resolution_status = get_resolution(&(db_file->metadata[i].res_orig[1]), &(db_file->metadata[i].res_orig[0]), image , image_size);
-    if (get_resolution_status) {
-        return get_resolution_status;
+    //comptage des références aux images de l'entrée (partagées ou non)
+    int ref_status = write_status ? write_status : index_ref_slot_blobs(db_file, i);
+    if (ref_status) {
+        //la place des images écrites ici redevient libre (l'erreur d'origine prime, comme dans write_blob)
+        for (int res = 0; res < NB_RES; ++res) {
+            index_free_extent(db_file, written[res], db_file->metadata[i].size[res]);
+        }
+        index_remove_slot(db_file, i);
+        db_file->metadata[i].is_valid = EMPTY;
+        index_push_free_slot(db_file, i);
+        return ref_status;
     }
 
-    //mise à jour du header
+    /* ====== mise à jour du header (en mémoire) ====== */
     db_file->header.num_files += 1;
     db_file->header.db_version += 1;
 
-    //écriture sur le disque
+    item->slot = i;
+    return 0;
+}
 
-    //metadata
-    //positionnement
-    long initial_offset_for_metadata = sizeof(struct pictdb_header) + i * sizeof(struct pict_metadata);
-    int fseek_status = fseek(db_file->fpdb, initial_offset_for_metadata, SEEK_SET); //on se place au bon pictID dans la metadata
-    if (fseek_status != 0) {
+/********************************************************************//*
+ * Positionne fpdb à la fin du fichier et renvoie cette position.
+ */
+static int seek_end_of_file(struct pictdb_file* db_file, uint64_t* end_of_file)
+{
+    if (fseek(db_file->fpdb, 0, SEEK_END) != 0) {
         return ERR_IO;
     }
-
-    //écriture
-    int num_written = fwrite(&(db_file->metadata[i]), sizeof(struct pict_metadata), 1, db_file->fpdb);
-    if (num_written != 1) {
+    long end = ftell(db_file->fpdb);
+    if (end < 0) {
         return ERR_IO;
     }
+    *end_of_file = end;
+    return 0;
+}
+
+/********************************************************************//*
+ * Écrit sur le disque les metadata des entrées first à last (comprises),
+ * en une seule écriture par partie contiguë du fichier, puis le header.
+ * Si un journal est attaché, la mise à jour y est d'abord enregistrée.
+ */
+static int write_metadata_and_header(struct pictdb_file* db_file, uint32_t first, uint32_t last)
+{
+    int journal_status = journal_commit(db_file, first, last);
+    if (journal_status) {
+        return journal_status;
+    }
+
+    //metadata
+    int write_status = write_metadata_range(db_file, first, last);
+    if (write_status) {
+        return write_status;
+    }
 
     //header
     //positionnement
-    fseek_status = fseek(db_file->fpdb, 0, SEEK_SET); //on se place au premier pict_id dans la metadata
+    int fseek_status = fseek(db_file->fpdb, 0, SEEK_SET); //on se place au début du fichier
     if (fseek_status != 0) {
         return ERR_IO;
     }
     //écriture
-    num_written = fwrite(&(db_file->header), sizeof(struct pictdb_header), 1, db_file->fpdb);
+    size_t num_written = fwrite(&(db_file->header), sizeof(struct pictdb_header), 1, db_file->fpdb);
     if (num_written != 1) {
         return ERR_IO;
     }
+    return journal_checkpoint(db_file);
+}
+
+/********************************************************************//*
+ * Génération en arrière-plan des images réduites (si une file de dérivation est attachée)
+ */
+static int queue_reduced_images(struct pictdb_file* db_file, int slot)
+{
+    if (db_file->metadata[slot].size[RES_THUMB] == 0 || db_file->metadata[slot].size[RES_SMALL] == 0) {
+        return derive_queue_push(db_file, slot);
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Function used to insert an image in the database
+ */
+int do_insert(const char* const image, size_t image_size, char* pict_id, struct pictdb_file* db_file)
+{
+    struct insert_item item = {.image = image, .image_size = image_size, .pict_id = pict_id, .slot = -1};
+    int probe_status = probe_item(&item, &db_file->header);
+    if (probe_status) {
+        return probe_status;
+    }
+
+    uint64_t end_of_file = 0;
+    int seek_status = seek_end_of_file(db_file, &end_of_file);
+    if (seek_status) {
+        release_reduced(&item);
+        return seek_status;
+    }
+
+    int insert_status = insert_in_memory(&item, db_file, &end_of_file);
+    release_reduced(&item);
+    if (insert_status) {
+        return insert_status;
+    }
+
+    //écriture sur le disque
+    int write_status = write_metadata_and_header(db_file, item.slot, item.slot);
+    if (write_status) {
+        return write_status;
+    }
+
+    return queue_reduced_images(db_file, item.slot);
+}
+
+/*! \struct batch_writer
+    \brief État de l'écriture d'un lot : fin du fichier et plage des metadata modifiées.
+*/
+struct batch_writer {
+    uint64_t end_of_file;
+    uint32_t first_dirty;
+    uint32_t last_dirty;
+    size_t nb_inserted;
+};
+
+/********************************************************************//*
+ * Prépare l'écriture d'un lot (fpdb positionné à la fin du fichier).
+ */
+static int batch_writer_start(struct batch_writer* writer, struct insert_item* items, size_t nb_items,
+                              struct pictdb_file* db_file)
+{
+    writer->first_dirty = UINT32_MAX;
+    writer->last_dirty = 0;
+    writer->nb_inserted = 0;
+    for (size_t k = 0; k < nb_items; ++k) {
+        items[k].status = ERR_IO; //tant qu'elle n'a pas été traitée
+        items[k].slot = -1;
+        items[k].reduced[RES_THUMB] = items[k].reduced[RES_SMALL] = NULL;
+    }
+    return seek_end_of_file(db_file, &writer->end_of_file);
+}
 
+/********************************************************************//*
+ * Ajoute au lot une image déjà analysée (dont le status est celui de probe_item).
+ */
+static void batch_writer_append(struct batch_writer* writer, struct insert_item* item, struct pictdb_file* db_file)
+{
+    if (item->status) {
+        release_reduced(item);
+        return;
+    }
+    item->status = insert_in_memory(item, db_file, &writer->end_of_file);
+    release_reduced(item);
+    if (item->status == 0) {
+        ++writer->nb_inserted;
+        if ((uint32_t) item->slot < writer->first_dirty) {
+            writer->first_dirty = item->slot;
+        }
+        if ((uint32_t) item->slot > writer->last_dirty) {
+            writer->last_dirty = item->slot;
+        }
+    }
+}
+
+/********************************************************************//*
+ * Écrit, une seule fois pour tout le lot, les metadata modifiées et le
+ * header, puis met en file la génération des images réduites.
+ */
+static int batch_writer_finish(struct batch_writer* writer, struct insert_item* items, size_t nb_items,
+                               struct pictdb_file* db_file)
+{
+    if (writer->nb_inserted == 0) {
+        return 0;
+    }
+
+    int write_status = write_metadata_and_header(db_file, writer->first_dirty, writer->last_dirty);
+    if (write_status) {
+        return write_status;
+    }
+
+    for (size_t k = 0; k < nb_items; ++k) {
+        if (items[k].status == 0) {
+            int queue_status = queue_reduced_images(db_file, items[k].slot);
+            if (queue_status) {
+                return queue_status;
+            }
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/********************************************************************//*
+ * Inserts several images at once: their contents are appended one after
+ * the other (unless they fit in a free extent) and the dirty metadata
+ * range and the header are written once.
+ */
+int do_insert_batch(struct insert_item* items, size_t nb_items, struct pictdb_file* db_file)
+{
+    if (items == NULL && nb_items > 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct batch_writer writer;
+    int start_status = batch_writer_start(&writer, items, nb_items, db_file);
+    if (start_status) {
+        return start_status;
+    }
+
+    for (size_t k = 0; k < nb_items; ++k) {
+        items[k].status = probe_item(&items[k], &db_file->header);
+        batch_writer_append(&writer, &items[k], db_file);
+        if (items[k].status == ERR_IO) {
+            //le fichier n'est plus dans un état connu : on n'écrit pas la suite du lot
+            break;
+        }
+    }
+
+    return batch_writer_finish(&writer, items, nb_items, db_file);
+}
+
+/*! \struct probe_pool
+    \brief Images d'un lot partagées entre les threads d'analyse et le thread d'écriture.
+*/
+struct probe_pool {
+    struct insert_item* items;
+    size_t nb_items;
+    size_t next_to_probe; // prochaine image à analyser
+    unsigned char* probed; // probed[k] != 0 une fois l'image k analysée
+    struct pictdb_header header; // copie du header (modifié par le thread d'écriture pendant l'analyse)
+    int stopping; // l'écriture a échoué, les images restantes ne sont plus analysées
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/********************************************************************//*
+ * Thread d'analyse : calcule SHA et résolution des images (et leurs images
+ * réduites en mode eager), dans l'ordre.
+ */
+static void* probe_thread_main(void* arg)
+{
+    struct probe_pool* pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stopping && pool->next_to_probe < pool->nb_items) {
+        size_t k = pool->next_to_probe++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        int status = probe_item(&pool->items[k], &pool->header);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->items[k].status = status;
+        pool->probed[k] = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/********************************************************************//*
+ * Same as do_insert_batch, but the images are hashed and probed by a pool
+ * of threads while the calling thread appends them to the file, in order.
+ */
+int do_insert_batch_parallel(struct insert_item* items, size_t nb_items, struct pictdb_file* db_file,
+                             unsigned int nb_threads)
+{
+    if (nb_threads <= 1 || nb_items <= 1) {
+        return do_insert_batch(items, nb_items, db_file);
+    }
+    if (items == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (nb_threads > MAX_PROBE_THREADS) {
+        nb_threads = MAX_PROBE_THREADS;
+    }
+
+    struct batch_writer writer;
+    int start_status = batch_writer_start(&writer, items, nb_items, db_file);
+    if (start_status) {
+        return start_status;
+    }
+
+    struct probe_pool pool = {.items = items, .nb_items = nb_items, .next_to_probe = 0, .stopping = 0,
+                              .header = db_file->header};
+    pool.probed = calloc(nb_items, sizeof(unsigned char));
+    if (pool.probed == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pthread_t threads[MAX_PROBE_THREADS];
+    unsigned int nb_started = 0;
+    while (nb_started < nb_threads && pthread_create(&threads[nb_started], NULL, probe_thread_main, &pool) == 0) {
+        ++nb_started;
+    }
+
+    int ret = 0;
+    if (nb_started == 0) {
+        ret = ERR_OUT_OF_MEMORY;
+    } else {
+        //le thread appelant est le seul à écrire dans le fichier, dans l'ordre du lot
+        for (size_t k = 0; k < nb_items; ++k) {
+            pthread_mutex_lock(&pool.mutex);
+            while (!pool.probed[k]) {
+                pthread_cond_wait(&pool.cond, &pool.mutex);
+            }
+            pthread_mutex_unlock(&pool.mutex);
+
+            batch_writer_append(&writer, &items[k], db_file);
+            if (items[k].status == ERR_IO) {
+                //le fichier n'est plus dans un état connu : on n'écrit pas la suite du lot
+                pthread_mutex_lock(&pool.mutex);
+                pool.stopping = 1;
+                pthread_mutex_unlock(&pool.mutex);
+                break;
+            }
+        }
+    }
+
+    for (unsigned int t = 0; t < nb_started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    //les images non écrites (arrêt sur erreur) ne doivent pas être vues comme insérées
+    for (size_t k = 0; k < nb_items; ++k) {
+        if (items[k].slot < 0 && items[k].status == 0) {
+            items[k].status = ERR_IO;
+        }
+        release_reduced(&items[k]);
+    }
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.mutex);
+    free(pool.probed);
+
+    if (ret) {
+        return ret;
+    }
+    return batch_writer_finish(&writer, items, nb_items, db_file);
+}
@@ -0,0 +1,260 @@
+/**
+ * @file db_journal.c
+ * @brief pictDB library: write-ahead journal of the metadata updates.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fsync, ftruncate, pread and fileno
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "db_journal.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // for malloc, calloc and free
+#include <string.h>
+#include <unistd.h> // for fsync, ftruncate and pread
+
+#define CHECKSUM_BASIS 14695981039346656037ULL
+#define CHECKSUM_PRIME 1099511628211ULL
+
+/*! \struct db_journal
+    \brief Journal attached to an opened pictDB.
+*/
+struct db_journal {
+    FILE* file;
+};
+
+/********************************************************************//*
+ * Adds size bytes to a checksum (64 bits FNV-1a).
+ */
+static uint64_t checksum_update(uint64_t checksum, const void* data, size_t size)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        checksum ^= bytes[i];
+        checksum *= CHECKSUM_PRIME;
+    }
+    return checksum;
+}
+
+/********************************************************************//*
+ * Returns the checksum of a record: its new header, then its entries.
+ */
+static uint64_t record_checksum(struct journal_record const* record, const struct pict_metadata* entries)
+{
+    uint64_t checksum = checksum_update(CHECKSUM_BASIS, &record->header, sizeof(struct pictdb_header));
+    return checksum_update(checksum, entries, (size_t) record->nb_slots * sizeof(struct pict_metadata));
+}
+
+/********************************************************************//*
+ * Reads the header as it is on the disk (pending writes are flushed first).
+ */
+static int read_disk_header(struct pictdb_file* db_file, struct pictdb_header* header)
+{
+    if (fflush(db_file->fpdb) != 0) {
+        return ERR_IO;
+    }
+    ssize_t nb_read = pread(fileno(db_file->fpdb), header, sizeof(struct pictdb_header), 0);
+    return nb_read == (ssize_t) sizeof(struct pictdb_header) ? 0 : ERR_IO;
+}
+
+/********************************************************************//*
+ * Flushes and syncs a file.
+ */
+static int sync_file(FILE* file)
+{
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Empties the journal.
+ */
+static int truncate_journal(FILE* file)
+{
+    if (fflush(file) != 0 || ftruncate(fileno(file), 0) != 0) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Writes the record (already in memory) in place in the database, then
+ * rebuilds the index from the replayed metadata.
+ */
+static int apply_record(struct pictdb_file* db_file, struct journal_record const* record,
+                        const struct pict_metadata* entries)
+{
+    const uint32_t last = record->first_slot + record->nb_slots - 1;
+    db_file->header = record->header;
+    memcpy(&db_file->metadata[record->first_slot], entries, (size_t) record->nb_slots * sizeof(struct pict_metadata));
+
+    int write_status = write_metadata_range(db_file, record->first_slot, last);
+    if (write_status) {
+        return write_status;
+    }
+    if (fseek(db_file->fpdb, 0, SEEK_SET) != 0
+        || fwrite(&db_file->header, sizeof(struct pictdb_header), 1, db_file->fpdb) != 1) {
+        return ERR_IO;
+    }
+    int sync_status = sync_file(db_file->fpdb);
+    if (sync_status) {
+        return sync_status;
+    }
+
+    //les tables de l'index ont été construites avec les anciennes metadata
+    free_index(db_file);
+    return build_index(db_file);
+}
+
+/********************************************************************//*
+ * Replays the last record of the journal if its update was interrupted.
+ */
+static int replay(struct pictdb_file* db_file, FILE* file)
+{
+    struct journal_record record;
+    if (fseek(file, 0, SEEK_SET) != 0 || fread(&record, sizeof(record), 1, file) != 1) {
+        //journal vide (ou enregistrement incomplet : la mise à jour n'avait pas commencé)
+        return truncate_journal(file);
+    }
+    if (memcmp(record.magic, JOURNAL_MAGIC, sizeof(record.magic)) != 0 || record.nb_slots == 0
+        || (uint64_t) record.first_slot + record.nb_slots > db_capacity(db_file)) {
+        return truncate_journal(file);
+    }
+
+    struct pict_metadata* entries = malloc((size_t) record.nb_slots * sizeof(struct pict_metadata));
+    if (entries == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int status = 0;
+    struct pictdb_header disk_header;
+    if (fread(entries, sizeof(struct pict_metadata), record.nb_slots, file) == record.nb_slots
+        && record_checksum(&record, entries) == record.checksum) {
+        status = read_disk_header(db_file, &disk_header);
+        //le header est écrit en dernier : s'il a déjà changé, la mise à jour est complète (ou plus ancienne)
+        if (!status && disk_header.db_version == record.base_version) {
+            status = apply_record(db_file, &record, entries);
+        }
+    }
+    free(entries);
+
+    if (status) {
+        //le journal est gardé pour la prochaine ouverture
+        return status;
+    }
+    return truncate_journal(file);
+}
+
+/********************************************************************//*
+ * Opens the journal of a database, replays it if needed and attaches it.
+ */
+int journal_open(struct pictdb_file* db_file, const char* file_name)
+{
+    if (db_file == NULL || db_file->index == NULL || file_name == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const size_t length = strlen(file_name) + strlen(JOURNAL_EXTENSION) + 1;
+    char* name = malloc(length);
+    if (name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    snprintf(name, length, "%s%s", file_name, JOURNAL_EXTENSION);
+    FILE* file = fopen(name, "r+b");
+    if (file == NULL && errno == ENOENT) {
+        file = fopen(name, "w+b");
+    }
+    free(name);
+    if (file == NULL) {
+        return ERR_IO;
+    }
+
+    int replay_status = replay(db_file, file);
+    if (replay_status) {
+        fclose(file);
+        return replay_status;
+    }
+
+    struct db_journal* journal = calloc(1, sizeof(struct db_journal));
+    if (journal == NULL) {
+        fclose(file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    journal->file = file;
+    db_file->index->journal = journal;
+    return 0;
+}
+
+/********************************************************************//*
+ * Detaches and closes the journal.
+ */
+void journal_close(struct pictdb_file* db_file)
+{
+    if (db_file->index == NULL || db_file->index->journal == NULL) {
+        return;
+    }
+    fclose(db_file->index->journal->file);
+    free(db_file->index->journal);
+    db_file->index->journal = NULL;
+}
+
+/********************************************************************//*
+ * Writes and syncs the record of an update before it is written in place.
+ */
+int journal_commit(struct pictdb_file* db_file, uint32_t first, uint32_t last)
+{
+    if (db_file->index == NULL || db_file->index->journal == NULL) {
+        return 0;
+    }
+    FILE* file = db_file->index->journal->file;
+
+    //les images ajoutées doivent être sur le disque avant que l'enregistrement ne les référence
+    int sync_status = sync_file(db_file->fpdb);
+    if (sync_status) {
+        return sync_status;
+    }
+    struct pictdb_header disk_header;
+    int read_status = read_disk_header(db_file, &disk_header);
+    if (read_status) {
+        return read_status;
+    }
+
+    struct journal_record record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, JOURNAL_MAGIC, sizeof(record.magic));
+    record.base_version = disk_header.db_version;
+    record.first_slot = first;
+    record.nb_slots = last - first + 1;
+    record.header = db_file->header;
+    record.checksum = record_checksum(&record, &db_file->metadata[first]);
+
+    if (fseek(file, 0, SEEK_SET) != 0
+        || fwrite(&record, sizeof(record), 1, file) != 1
+        || fwrite(&db_file->metadata[first], sizeof(struct pict_metadata), record.nb_slots, file) != record.nb_slots) {
+        return ERR_IO;
+    }
+    return sync_file(file);
+}
+
+/********************************************************************//*
+ * Syncs the database once the update is written in place and empties the journal.
+ */
+int journal_checkpoint(struct pictdb_file* db_file)
+{
+    if (db_file->index == NULL || db_file->index->journal == NULL) {
+        return 0;
+    }
+    int sync_status = sync_file(db_file->fpdb);
+    if (sync_status) {
+        return sync_status;
+    }
+    return truncate_journal(db_file->index->journal->file);
+}
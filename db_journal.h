@@ -0,0 +1,85 @@
+/**
+ * @file db_journal.h
+ * @brief Header file for the write-ahead journal of a pictDB.
+ *
+ * An update of the metadata and of the header (do_insert, do_insert_batch,
+ * do_delete, store_reduced_images) takes several writes in the database
+ * file. When a journal is attached, the new content of the updated entries
+ * and of the header is first written and synced to the journal file (next
+ * to the database, its name followed by JOURNAL_EXTENSION); the database
+ * is then updated in place and synced, and the journal emptied.
+ *
+ * After a crash, journal_open replays the last complete record if the
+ * database header still has the version it had before that update: the
+ * recovery only reads the journal, never scans the database.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#ifndef PICTDBPRJ_DB_JOURNAL_H
+#define PICTDBPRJ_DB_JOURNAL_H
+
+#include "pictDB.h"
+#include <stdint.h>
+
+#define JOURNAL_EXTENSION ".jnl" // appended to the name of the database file
+#define JOURNAL_MAGIC "PDBJRNL" // 7 characters + '\0'
+
+/*! \struct journal_record
+    \brief Header of a journal record, followed by nb_slots struct pict_metadata
+    (the new content of the entries first_slot to first_slot + nb_slots - 1).
+*/
+struct journal_record {
+    char magic[8]; // JOURNAL_MAGIC
+    uint32_t base_version; // db_version of the header on the disk before the update
+    uint32_t first_slot;
+    uint32_t nb_slots;
+    uint32_t unused_32;
+    uint64_t checksum; // of the new header and the entries
+    struct pictdb_header header; // new content of the header
+};
+
+/**
+ * @brief Opens (or creates) the journal of a database, replays its last
+ *        record if the update it describes was interrupted, and attaches it.
+ *        The index of the database must already be built (it is rebuilt
+ *        after a replay).
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param file_name the name of the database file.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int journal_open(struct pictdb_file* db_file, const char* file_name);
+
+/**
+ * @brief Detaches and closes the journal. Called by free_index.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ */
+void journal_close(struct pictdb_file* db_file);
+
+/**
+ * @brief Makes an update durable before it is written in place: syncs the
+ *        images already appended to the database, then writes and syncs a
+ *        record with the current (in-memory) header and entries first to last.
+ *        Does nothing if no journal is attached.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param first the first updated entry.
+ * @param last the last updated entry.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int journal_commit(struct pictdb_file* db_file, uint32_t first, uint32_t last);
+
+/**
+ * @brief Ends an update once it is written in place: syncs the database and
+ *        empties the journal. Does nothing if no journal is attached.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int journal_checkpoint(struct pictdb_file* db_file);
+
+#endif
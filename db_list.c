@@ -9,6 +9,7 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h" //for index_slot_valid
 
 #include <stdio.h>
 #include <json-c/json.h>
@@ -21,10 +22,11 @@ const char* do_list(struct pictdb_file const* pictdb_file, enum do_list_mode do_
 	if (do_list_mode == STDOUT)
 	{
 		print_header(&pictdb_file->header);
+		print_occupancy(pictdb_file);
 
 	    if(pictdb_file->header.num_files != 0) {
-	        for (int i = 0; i < pictdb_file->header.max_files; ++i) {
-	            if (pictdb_file->metadata[i].is_valid == NON_EMPTY) {
+	        for (uint32_t i = 0; i < db_capacity(pictdb_file); ++i) {
+	            if (index_slot_valid(pictdb_file->index, i)) {
 	                print_metadata(&pictdb_file->metadata[i]);
 	            }
 	        }
@@ -38,8 +40,8 @@ const char* do_list(struct pictdb_file const* pictdb_file, enum do_list_mode do_
 		struct json_object* json_array = json_object_new_array();
 
 		if(pictdb_file->header.num_files != 0) {
-			for (int i = 0; i < pictdb_file->header.max_files; ++i) {
-				if (pictdb_file->metadata[i].is_valid == NON_EMPTY) {
+			for (uint32_t i = 0; i < db_capacity(pictdb_file); ++i) {
+				if (index_slot_valid(pictdb_file->index, i)) {
 					const char* picture_id = pictdb_file->metadata[i].pict_id;
 					//Create the json string to add to the array
 					struct json_object* value_to_add = json_object_new_string(picture_id);
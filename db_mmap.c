@@ -0,0 +1,230 @@
+/**
+ * @file db_mmap.c
+ * @brief pictDB library: memory-mapped (read-only) database mode.
+ *
+ * In this mode (used by the one-shot reads of pictDBM) the whole database
+ * file is mapped read-only: the header is copied from the mapping, the
+ * metadata array points directly into it and images can be accessed as
+ * views into the mapping, without any copy.
+ *
+ * do_open_paged loads the id table from the index file (see index_save)
+ * instead of scanning every metadata: a one-shot lookup only faults in
+ * the metadata pages it touches.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno
+
+#include "pictDB.h"
+#include "db_index.h" //for index_find_id, index_load and index_save
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // for malloc and free
+#include <string.h>
+#include <sys/mman.h> // for mmap and munmap
+#include <sys/stat.h> // for fstat
+
+/********************************************************************//*
+ * Maps the whole database file (read-only) and records the mapping in the index.
+ */
+static int map_file(struct pictdb_file* const pict_file, const char** mapping, size_t* mapping_size)
+{
+    struct stat file_stat;
+    if (fstat(fileno(pict_file->fpdb), &file_stat) != 0) {
+        return ERR_IO;
+    }
+    if (file_stat.st_size < (off_t) sizeof(struct pictdb_header)) {
+        return ERR_IO;
+    }
+
+    void* map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fileno(pict_file->fpdb), 0);
+    if (map == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    *mapping = map;
+    *mapping_size = file_stat.st_size;
+    return 0;
+}
+
+/********************************************************************//*
+ * Opens and maps the database file, copies its header and points the
+ * metadata array into the mapping (nothing is read yet but the header).
+ */
+static int map_database(const char* file_name, struct pictdb_file* const pict_file,
+                        const char** mapping, size_t* mapping_size)
+{
+    pict_file->metadata = NULL;
+    pict_file->index = NULL;
+
+    pict_file->fpdb = fopen(file_name, "rb");
+    if (pict_file->fpdb == NULL) {
+        return ERR_IO;
+    }
+
+    int map_status = map_file(pict_file, mapping, mapping_size);
+    if (map_status) {
+        fclose(pict_file->fpdb);
+        pict_file->fpdb = NULL;
+        return map_status;
+    }
+
+    //le header est copié (il est petit), les metadata restent dans la projection
+    memcpy(&pict_file->header, *mapping, sizeof(struct pictdb_header));
+    if (pict_file->header.max_files > MAX_MAX_FILES
+        || *mapping_size < sizeof(struct pictdb_header) + (size_t) pict_file->header.max_files * sizeof(struct pict_metadata)) {
+        munmap((void*) *mapping, *mapping_size);
+        fclose(pict_file->fpdb);
+        pict_file->fpdb = NULL;
+        return ERR_MAX_FILES;
+    }
+    pict_file->metadata = (struct pict_metadata*) (*mapping + sizeof(struct pictdb_header));
+    return 0;
+}
+
+/********************************************************************//*
+ * Tells whether the metadata of a database are not all in the array following the header.
+ */
+static int has_metadata_chunks(struct pictdb_file const* pict_file)
+{
+    return PICTDB_FORMAT(pict_file->header) >= PICTDB_FORMAT_CHUNKED && pict_file->header.unused_64 != 0;
+}
+
+/********************************************************************//*
+ * Builds the complete index of a mapped database (reads all the metadata).
+ */
+static int index_mapping(struct pictdb_file* const pict_file, const char* mapping, size_t mapping_size)
+{
+    /*avec des blocs de metadata supplémentaires (format 1), toutes les entrées doivent être
+    dans un même tableau : la partie suivant le header est alors copiée hors de la projection*/
+    const int owns_metadata = has_metadata_chunks(pict_file);
+    if (owns_metadata) {
+        const size_t metadata_size = (size_t) pict_file->header.max_files * sizeof(struct pict_metadata);
+        pict_file->metadata = malloc(metadata_size);
+        if (pict_file->metadata == NULL) {
+            munmap((void*) mapping, mapping_size);
+            fclose(pict_file->fpdb);
+            pict_file->fpdb = NULL;
+            return ERR_OUT_OF_MEMORY;
+        }
+        memcpy(pict_file->metadata, mapping + sizeof(struct pictdb_header), metadata_size);
+    }
+
+    int index_status = build_index(pict_file);
+    if (index_status) {
+        if (owns_metadata) {
+            free(pict_file->metadata);
+        }
+        pict_file->metadata = NULL;
+        munmap((void*) mapping, mapping_size);
+        fclose(pict_file->fpdb);
+        pict_file->fpdb = NULL;
+        return index_status;
+    }
+    pict_file->index->mapping = mapping;
+    pict_file->index->mapping_size = mapping_size;
+    pict_file->index->owns_metadata = owns_metadata;
+
+    return 0;
+}
+
+/********************************************************************//*
+ * Opens the database file in read-only memory-mapped mode, with the id
+ * table of its index file: the metadata pages are only read when a
+ * lookup touches them.
+ */
+int do_open_paged(const char* file_name, struct pictdb_file* const pict_file)
+{
+    const char* mapping = NULL;
+    size_t mapping_size = 0;
+    int map_status = map_database(file_name, pict_file, &mapping, &mapping_size);
+    if (map_status) {
+        return map_status;
+    }
+
+    if (!has_metadata_chunks(pict_file)) {
+        int load_status = index_load(pict_file, file_name);
+        if (load_status == 0) {
+            pict_file->index->mapping = mapping;
+            pict_file->index->mapping_size = mapping_size;
+            return 0;
+        }
+        if (load_status != ERR_FILE_NOT_FOUND) {
+            pict_file->metadata = NULL;
+            munmap((void*) mapping, mapping_size);
+            fclose(pict_file->fpdb);
+            pict_file->fpdb = NULL;
+            return load_status;
+        }
+    }
+
+    //pas de fichier d'index à jour : l'index est construit en entier, puis sauvé pour les ouvertures suivantes
+    int index_status = index_mapping(pict_file, mapping, mapping_size);
+    if (index_status) {
+        return index_status;
+    }
+    if (!has_metadata_chunks(pict_file)) {
+        //le fichier d'index n'est qu'un cache : une erreur d'écriture n'empêche pas la lecture
+        (void) index_save(pict_file, file_name);
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Unmaps and closes a database opened with do_open_paged.
+ */
+void do_close_mmap(struct pictdb_file* const pict_file)
+{
+    if (pict_file->index != NULL && pict_file->index->mapping != NULL) {
+        munmap((void*) pict_file->index->mapping, pict_file->index->mapping_size);
+    }
+    //sauf si elles ont été copiées, les metadata appartiennent à la projection et ne doivent pas être libérées
+    if (pict_file->index != NULL && pict_file->index->owns_metadata) {
+        free(pict_file->metadata);
+    }
+    pict_file->metadata = NULL;
+    free_index(pict_file);
+
+    if (pict_file->fpdb != NULL) {
+        fclose(pict_file->fpdb);
+        pict_file->fpdb = NULL;
+    }
+}
+
+/********************************************************************//*
+ * Gives a view (pointer and length) on an image of a memory-mapped database.
+ */
+int do_read_view(const char* pict_id, const int resolution_code, const char** image, uint32_t* const image_size,
+                 struct pictdb_file const* db_file)
+{
+    if (resolution_code != RES_THUMB && resolution_code != RES_SMALL && resolution_code != RES_ORIG) {
+        return ERR_RESOLUTIONS;
+    }
+    if (db_file->index == NULL || db_file->index->mapping == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int index = index_find_id(db_file, pict_id);
+    if (index < 0) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    //la projection est en lecture seule : les résolutions manquantes ne peuvent pas être créées ici
+    const struct pict_metadata* found = &db_file->metadata[index];
+    if (found->offset[resolution_code] == 0 || found->size[resolution_code] == 0) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    //l'image doit être entièrement contenue dans la projection
+    if (found->offset[resolution_code] + found->size[resolution_code] > db_file->index->mapping_size) {
+        return ERR_IO;
+    }
+
+    *image = db_file->index->mapping + found->offset[resolution_code];
+    *image_size = found->size[resolution_code];
+    return 0;
+}
@@ -7,30 +7,30 @@
  * @date Apr 2016
  */
 
+#define _POSIX_C_SOURCE 200809L // for fileno and pread
+
 #include "pictDB.h"
 #include "image_content.h" //for lazily_resize
+#include "db_index.h" //for index_find_id
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h> // for pread
 
 
 #define found db_file->metadata[index]
 
 
-int do_read(const char* pict_id, const int resolution_code, char** image_buffer, uint32_t * const image_size, struct pictdb_file * const db_file)
+/********************************************************************//*
+ * Locates an image (creating its resolution if needed) without reading it.
+ */
+int do_locate(const char* pict_id, const int resolution_code, uint64_t * const offset, uint32_t * const image_size, struct pictdb_file * const db_file)
 {
 
     //we first need to locate the good metadata corresponding to the name of the image.
-    int iter = 0;
-    int index = -1;
-    while(index == -1 && iter < db_file->header.max_files) {
-        if(strncmp(pict_id, db_file->metadata[iter].pict_id, strlen(pict_id)+1) == 0) {
-            index = iter ;
-        }
-        ++iter;
-    }
+    int index = index_find_id(db_file, pict_id);
 
     //test wether the image was found, and if found, wether the original image is correctly referenced in the metadata
     if(index < 0) {
@@ -52,8 +52,25 @@ int do_read(const char* pict_id, const int resolution_code, char** image_buffer,
         return ERR_FILE_NOT_FOUND;
     }
 
+    *offset = found.offset[resolution_code];
+    *image_size = found.size[resolution_code];
+    return 0;
+}
+
+/********************************************************************//*
+ * Extracts image from image database and load it in a new buffer.
+ */
+int do_read(const char* pict_id, const int resolution_code, char** image_buffer, uint32_t * const image_size, struct pictdb_file * const db_file)
+{
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    int locate_status = do_locate(pict_id, resolution_code, &offset, &size, db_file);
+    if(locate_status) {
+        return locate_status;
+    }
+
     //calloc of the content of image_buffer, since it is the pointer to memory where the image is stored.
-    char* actual_image = calloc(found.size[resolution_code], sizeof(char)); //we save place on the heap to store the image
+    char* actual_image = calloc(size, sizeof(char)); //we save place on the heap to store the image
     if(actual_image == NULL) {
         return ERR_OUT_OF_MEMORY;
     }
@@ -65,14 +82,14 @@ int do_read(const char* pict_id, const int resolution_code, char** image_buffer,
     }
 
     //placement
-    int errorSeek = fseek(db_file->fpdb, found.offset[resolution_code], SEEK_SET);
+    int errorSeek = fseek(db_file->fpdb, offset, SEEK_SET);
     if(errorSeek == -1) {
         free_the_buffer(&actual_image);
         return ERR_IO;
     }
 
     //reading and loading the image
-    size_t actual_size = fread(actual_image, sizeof(char), found.size[resolution_code], db_file->fpdb);
+    size_t actual_size = fread(actual_image, sizeof(char), size, db_file->fpdb);
     if(actual_size == 0) {
         free_the_buffer(&actual_image);
         return ERR_IO;
@@ -82,3 +99,32 @@ int do_read(const char* pict_id, const int resolution_code, char** image_buffer,
     *image_buffer = actual_image;
     return 0;
 }
+
+/********************************************************************//*
+ * Reads size bytes at offset in the database file, in a new buffer,
+ * without moving the FILE position (safe with concurrent readers).
+ */
+int read_image_at(struct pictdb_file const* db_file, uint64_t offset, uint32_t size, char** image_buffer)
+{
+    if(db_file->fpdb == NULL) {
+        return ERR_IO;
+    }
+
+    char* buffer = calloc(size, sizeof(char));
+    if(buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    size_t total = 0;
+    while(total < size) {
+        ssize_t num_read = pread(fileno(db_file->fpdb), buffer + total, size - total, offset + total);
+        if(num_read <= 0) {
+            free_the_buffer(&buffer);
+            return ERR_IO;
+        }
+        total += num_read;
+    }
+
+    *image_buffer = buffer;
+    return 0;
+}
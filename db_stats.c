@@ -0,0 +1,132 @@
+/**
+ * @file db_stats.c
+ * @brief pictDB library: space accounting (live and dead bytes, fragmentation).
+ *
+ * The live bytes are maintained by the reference counts of the in-memory
+ * index; every other byte after the metadata (array and chunks) is dead,
+ * i.e. could be reclaimed by gc (or by compaction, see db_compact.c).
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for fileno
+
+#include "pictDB.h"
+#include "db_index.h"
+
+#include <inttypes.h> // for PRIu64
+#include <stdio.h>
+#include <stdlib.h> // for calloc, qsort and free
+#include <sys/stat.h> // for fstat
+
+/********************************************************************//*
+ * Orders the images by offset.
+ */
+static int compare_blobs(const void* a, const void* b)
+{
+    const struct blob_count* blob_a = a;
+    const struct blob_count* blob_b = b;
+    if (blob_a->offset != blob_b->offset) {
+        return blob_a->offset < blob_b->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Computes the space accounting of an opened database.
+ */
+int do_stats(struct pictdb_file const* db_file, struct pictdb_stats* stats)
+{
+    if (db_file == NULL || stats == NULL || db_file->index == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const struct pictdb_index* index = db_file->index;
+
+    //la taille du fichier doit tenir compte des écritures en attente
+    struct stat file_stat;
+    if (fflush(db_file->fpdb) != 0 || fstat(fileno(db_file->fpdb), &file_stat) != 0) {
+        return ERR_IO;
+    }
+
+    stats->file_size = file_stat.st_size;
+    const uint64_t data_start = sizeof(struct pictdb_header)
+                                + (uint64_t) db_file->header.max_files * sizeof(struct pict_metadata);
+    stats->metadata_bytes = data_start;
+    for (uint32_t c = 0; c < index->nb_chunks; ++c) {
+        stats->metadata_bytes += sizeof(struct metadata_chunk_header)
+                                 + (uint64_t) index->chunks[c].nb_slots * sizeof(struct pict_metadata);
+    }
+    stats->live_bytes = index->live_bytes;
+    const uint64_t data_bytes = stats->file_size > stats->metadata_bytes ? stats->file_size - stats->metadata_bytes : 0;
+    stats->dead_bytes = data_bytes > stats->live_bytes ? data_bytes - stats->live_bytes : 0;
+    stats->fragmentation = data_bytes > 0 ? 100.0 * stats->dead_bytes / data_bytes : 0.0;
+
+    stats->nb_blobs = index->nb_blobs;
+    stats->nb_shared_blobs = 0;
+    stats->nb_references = 0;
+    stats->nb_holes = 0;
+    stats->largest_hole = 0;
+
+    /*images triées par position, pour trouver les trous entre elles ;
+    les blocs de metadata y figurent aussi (sans référence) car ils occupent la zone des images*/
+    struct blob_count* blobs = calloc((size_t) index->nb_blobs + index->nb_chunks + 1, sizeof(struct blob_count));
+    if (blobs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    uint32_t nb = 0;
+    for (uint32_t b = 0; b < index->blob_capacity && nb < index->nb_blobs; ++b) {
+        if (index->blobs[b].offset != 0) {
+            blobs[nb++] = index->blobs[b];
+        }
+    }
+    for (uint32_t c = 0; c < index->nb_chunks; ++c) {
+        blobs[nb].offset = index->chunks[c].position;
+        blobs[nb].size = sizeof(struct metadata_chunk_header)
+                         + index->chunks[c].nb_slots * sizeof(struct pict_metadata);
+        blobs[nb].refcount = 0;
+        ++nb;
+    }
+    qsort(blobs, nb, sizeof(struct blob_count), compare_blobs);
+
+    uint64_t cursor = data_start;
+    for (uint32_t k = 0; k <= nb; ++k) {
+        //la fin du fichier après la dernière image compte comme un trou
+        const uint64_t next = k < nb ? blobs[k].offset : stats->file_size;
+        if (next > cursor) {
+            ++stats->nb_holes;
+            if (next - cursor > stats->largest_hole) {
+                stats->largest_hole = next - cursor;
+            }
+        }
+        if (k < nb) {
+            stats->nb_references += blobs[k].refcount;
+            if (blobs[k].refcount > 1) {
+                ++stats->nb_shared_blobs;
+            }
+            if (blobs[k].offset + blobs[k].size > cursor) {
+                cursor = blobs[k].offset + blobs[k].size;
+            }
+        }
+    }
+
+    free(blobs);
+    return 0;
+}
+
+/********************************************************************//*
+ * Prints the space accounting of a database.
+ */
+void print_stats(struct pictdb_stats const* stats)
+{
+    printf("*****************************************\n");
+    printf("**********DATABASE SPACE USAGE***********\n");
+    printf("FILE SIZE: %" PRIu64 "\tHEADER AND METADATA: %" PRIu64 "\n", stats->file_size, stats->metadata_bytes);
+    printf("LIVE BYTES: %" PRIu64 "\tDEAD BYTES: %" PRIu64 "\tFRAGMENTATION: %.1f%%\n",
+           stats->live_bytes, stats->dead_bytes, stats->fragmentation);
+    printf("IMAGES: %" PRIu32 "\tSHARED IMAGES: %" PRIu32 "\tREFERENCES: %" PRIu64 "\n",
+           stats->nb_blobs, stats->nb_shared_blobs, stats->nb_references);
+    printf("HOLES: %" PRIu32 "\tLARGEST HOLE: %" PRIu64 "\n", stats->nb_holes, stats->largest_hole);
+    printf("*****************************************\n");
+}
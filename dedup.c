@@ -8,6 +8,7 @@
 */
 
 #include "pictDB.h"
+#include "db_index.h" //for index_find_id and index_find_SHA
 #include <string.h>
 #include <stdlib.h>
 #include <openssl/sha.h>
@@ -27,7 +28,8 @@ int same_SHA_hash(const unsigned char* SHA1, const unsigned char* SHA2)
 }
 
 /********************************************************************//*
- * avoids the same image (same content) to be present several times in the database
+ * avoids the same image (same content) to be present several times in the database.
+ * Both checks go through the in-memory index, so they do not depend on max_files.
  */
 int do_name_and_content_dedup(struct pictdb_file* pictdb_file, uint32_t index)
 {
@@ -36,33 +38,29 @@ int do_name_and_content_dedup(struct pictdb_file* pictdb_file, uint32_t index)
         return ERR_IO;
     }
 
-    for (int i = 0; i < pictdb_file->header.max_files; ++i) {
-        //pour toutes les images valides autres que celle à la position index
-        if (i != index && pictdb_file->metadata[i].is_valid == NON_EMPTY) {
-            //si le nom de l’image est identique à celui de l’image à la position index
-            size_t size_of_pictid = strlen(pictdb_file->metadata[index].pict_id) + 1;
-            if (!strncmp(pictdb_file->metadata[index].pict_id, pictdb_file->metadata[i].pict_id, size_of_pictid)) {
-                return ERR_DUPLICATE_ID;
-            }
-
-            /*si la valeur SHA de l’image est identique à celle de l’image à la position
-            index, on peut alors éviter la duplication de l’image à la position index
-            (pour toutes ses résolutions)*/
-            if (same_SHA_hash(pictdb_file->metadata[index].SHA, pictdb_file->metadata[i].SHA)) {
-                /*modification de l’entrée index des métadonnées pour y référencer
-                les attributs de l’autre copie de l’image
-                (les trois offset et les deux tailles)
-                (la taille d’origine est forcément la même)*/
-                pictdb_file->metadata[index].offset[RES_THUMB] = pictdb_file->metadata[i].offset[RES_THUMB];
-                pictdb_file->metadata[index].offset[RES_SMALL] = pictdb_file->metadata[i].offset[RES_SMALL];
-                pictdb_file->metadata[index].offset[RES_ORIG] = pictdb_file->metadata[i].offset[RES_ORIG];
-
-                pictdb_file->metadata[index].size[RES_THUMB] = pictdb_file->metadata[i].size[RES_THUMB];
-                pictdb_file->metadata[index].size[RES_SMALL] = pictdb_file->metadata[i].size[RES_SMALL];
-
-                return 0;
-            }
-        }
+    //si une autre image valide porte déjà le même nom (recherche dans l'index des noms)
+    int same_id = index_find_id(pictdb_file, pictdb_file->metadata[index].pict_id);
+    if (same_id >= 0 && (uint32_t) same_id != index) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    /*si la valeur SHA de l’image est identique à celle d'une autre image valide
+    (recherche dans l'index des contenus), on peut alors éviter la duplication
+    de l’image à la position index (pour toutes ses résolutions)*/
+    int i = index_find_SHA(pictdb_file, pictdb_file->metadata[index].SHA, index);
+    if (i >= 0) {
+        /*modification de l’entrée index des métadonnées pour y référencer
+        les attributs de l’autre copie de l’image
+        (les trois offset et les deux tailles)
+        (la taille d’origine est forcément la même)*/
+        pictdb_file->metadata[index].offset[RES_THUMB] = pictdb_file->metadata[i].offset[RES_THUMB];
+        pictdb_file->metadata[index].offset[RES_SMALL] = pictdb_file->metadata[i].offset[RES_SMALL];
+        pictdb_file->metadata[index].offset[RES_ORIG] = pictdb_file->metadata[i].offset[RES_ORIG];
+
+        pictdb_file->metadata[index].size[RES_THUMB] = pictdb_file->metadata[i].size[RES_THUMB];
+        pictdb_file->metadata[index].size[RES_SMALL] = pictdb_file->metadata[i].size[RES_SMALL];
+
+        return 0;
     }
 
     //Si l’image à la position index n’a pas de doublon
@@ -0,0 +1,230 @@
+/**
+ * @file derive_queue.c
+ * @brief pictDB library: background generation of reduced images.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pthread_rwlock_t with -std=c99
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "derive_queue.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h> // for fflush
+#include <stdlib.h>
+#include <string.h>
+
+/*! \struct derive_job
+    \brief A picture whose reduced images have to be generated.
+
+ The SHA of the original is kept to detect that the slot was deleted
+ (and maybe reused, even by a picture with the same pict_id) before the
+ job was done: the reduced images are only stored for the original they
+ were made from. Unlike its offset, the SHA is not changed by compaction.
+*/
+struct derive_job {
+    uint32_t slot;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    struct derive_job* next;
+};
+
+/*! \struct derive_queue
+    \brief FIFO of derive_job and the threads consuming it.
+*/
+struct derive_queue {
+    struct pictdb_file* db_file;
+    pthread_rwlock_t* lock;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct derive_job* head;
+    struct derive_job* tail;
+    int stopping;
+    unsigned int nb_threads;
+    pthread_t threads[MAX_DERIVE_THREADS];
+};
+
+/********************************************************************//*
+ * Tells whether the slot still holds the original of the job.
+ */
+static int job_is_current(struct pictdb_file const* db_file, const struct derive_job* job)
+{
+    const struct pict_metadata* metadata = &db_file->metadata[job->slot];
+    return metadata->is_valid == NON_EMPTY && memcmp(metadata->SHA, job->SHA, SHA256_DIGEST_LENGTH) == 0;
+}
+
+/********************************************************************//*
+ * Generates the missing reduced images of one picture. The original is
+ * read under the shared lock, resized without lock and the results are
+ * stored under the exclusive lock.
+ */
+static void derive_picture(struct derive_queue* queue, const struct derive_job* job)
+{
+    struct pictdb_file* db_file = queue->db_file;
+
+    pthread_rwlock_rdlock(queue->lock);
+    if (!job_is_current(db_file, job)) {
+        pthread_rwlock_unlock(queue->lock);
+        return;
+    }
+    struct pict_metadata metadata = db_file->metadata[job->slot];
+    char* original = NULL;
+    int status = 0;
+    if (metadata.size[RES_THUMB] == 0 || metadata.size[RES_SMALL] == 0) {
+        status = read_image_at(db_file, metadata.offset[RES_ORIG], metadata.size[RES_ORIG], &original);
+    }
+    pthread_rwlock_unlock(queue->lock);
+    if (status || original == NULL) {
+        return;
+    }
+
+    //both reduced images are made from a single decoding of the original
+    int needed[RES_ORIG];
+    needed[RES_THUMB] = metadata.size[RES_THUMB] == 0;
+    needed[RES_SMALL] = metadata.size[RES_SMALL] == 0;
+    char* resized[RES_ORIG];
+    size_t resized_size[RES_ORIG];
+    status = create_reduced_images(original, metadata.size[RES_ORIG], &db_file->header, needed, resized, resized_size);
+    free_the_buffer(&original);
+    if (status) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(queue->lock);
+    if (job_is_current(db_file, job)) {
+        for (int res = RES_THUMB; res < RES_ORIG; ++res) {
+            //do_read may have created it synchronously in the meantime
+            if (db_file->metadata[job->slot].size[res] != 0) {
+                free_the_buffer(&resized[res]);
+            }
+        }
+        if (resized[RES_THUMB] != NULL || resized[RES_SMALL] != NULL) {
+            (void) store_reduced_images(db_file, job->slot, resized, resized_size);
+            fflush(db_file->fpdb);
+        }
+    }
+    pthread_rwlock_unlock(queue->lock);
+
+    for (int res = RES_THUMB; res < RES_ORIG; ++res) {
+        free_the_buffer(&resized[res]);
+    }
+}
+
+/********************************************************************//*
+ * Background thread: takes the jobs in FIFO order until stopped.
+ */
+static void* derive_thread_main(void* arg)
+{
+    struct derive_queue* queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        while (queue->head == NULL && !queue->stopping) {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        }
+        if (queue->stopping) {
+            pthread_mutex_unlock(&queue->mutex);
+            return NULL;
+        }
+        struct derive_job* job = queue->head;
+        queue->head = job->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+
+        derive_picture(queue, job);
+        free(job);
+    }
+}
+
+/********************************************************************//*
+ * Starts the background threads and attaches the queue to the database.
+ */
+int derive_queue_start(struct pictdb_file* db_file, unsigned int nb_threads, pthread_rwlock_t* lock)
+{
+    if (db_file->index == NULL || lock == NULL || nb_threads == 0 || nb_threads > MAX_DERIVE_THREADS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct derive_queue* queue = calloc(1, sizeof(struct derive_queue));
+    if (queue == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    queue->db_file = db_file;
+    queue->lock = lock;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+
+    db_file->index->derive_queue = queue;
+    for (unsigned int i = 0; i < nb_threads; ++i) {
+        if (pthread_create(&queue->threads[i], NULL, derive_thread_main, queue) != 0) {
+            derive_queue_stop(db_file);
+            return ERR_OUT_OF_MEMORY;
+        }
+        ++queue->nb_threads;
+    }
+    return 0;
+}
+
+/********************************************************************//*
+ * Stops the background threads and detaches the queue.
+ */
+void derive_queue_stop(struct pictdb_file* db_file)
+{
+    if (db_file->index == NULL || db_file->index->derive_queue == NULL) {
+        return;
+    }
+    struct derive_queue* queue = db_file->index->derive_queue;
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+
+    for (unsigned int i = 0; i < queue->nb_threads; ++i) {
+        pthread_join(queue->threads[i], NULL);
+    }
+
+    while (queue->head != NULL) {
+        struct derive_job* next = queue->head->next;
+        free(queue->head);
+        queue->head = next;
+    }
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+    db_file->index->derive_queue = NULL;
+}
+
+/********************************************************************//*
+ * Enqueues the generation of the reduced images of a picture.
+ */
+int derive_queue_push(struct pictdb_file* db_file, uint32_t slot)
+{
+    if (db_file->index == NULL || db_file->index->derive_queue == NULL) {
+        return 0;
+    }
+    struct derive_queue* queue = db_file->index->derive_queue;
+
+    struct derive_job* job = calloc(1, sizeof(struct derive_job));
+    if (job == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    job->slot = slot;
+    memcpy(job->SHA, db_file->metadata[slot].SHA, SHA256_DIGEST_LENGTH);
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tail == NULL) {
+        queue->head = job;
+    } else {
+        queue->tail->next = job;
+    }
+    queue->tail = job;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
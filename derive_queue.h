@@ -0,0 +1,54 @@
+/**
+ * @file derive_queue.h
+ * @brief Header file for the background generation of reduced images.
+ *
+ * When a derivation queue is attached to an opened pictDB, do_insert
+ * enqueues the generation of the RES_THUMB and RES_SMALL variants of the
+ * new picture, and background threads create them. do_read only resizes
+ * synchronously if the job has not been done yet.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#ifndef PICTDBPRJ_DERIVE_QUEUE_H
+#define PICTDBPRJ_DERIVE_QUEUE_H
+
+#include "pictDB.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define MAX_DERIVE_THREADS 16
+
+/**
+ * @brief Starts the background threads and attaches the queue to the database.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param nb_threads number of background threads (1 to MAX_DERIVE_THREADS).
+ * @param lock the reader-writer lock protecting db_file, shared with the other
+ *        threads using it: it is taken shared to read the original image and
+ *        exclusive to store the reduced ones.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int derive_queue_start(struct pictdb_file* db_file, unsigned int nb_threads, pthread_rwlock_t* lock);
+
+/**
+ * @brief Stops the background threads (the pending jobs are dropped) and
+ *        detaches the queue. Called by free_index.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ */
+void derive_queue_stop(struct pictdb_file* db_file);
+
+/**
+ * @brief Enqueues the generation of the reduced images of a picture.
+ *        Does nothing if no queue is attached to the database.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param slot the index of the picture in the metadata array.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int derive_queue_push(struct pictdb_file* db_file, uint32_t slot);
+
+#endif
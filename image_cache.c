@@ -0,0 +1,257 @@
+/**
+ * @file image_cache.c
+ * @brief pictDB_server: in-memory LRU cache of images.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pthread_mutex_t with -std=c99
+
+#include "pictDB.h"
+#include "image_cache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h> // for calloc and free
+#include <string.h>
+
+/*! \struct cache_entry
+    \brief A cached image, in its bucket and in the LRU list.
+*/
+struct cache_entry {
+    char pict_id[MAX_PIC_ID + 1];
+    int resolution_code;
+    char* image;
+    uint32_t image_size;
+    struct cache_entry* bucket_next;
+    struct cache_entry* more_recent;
+    struct cache_entry* less_recent;
+};
+
+/********************************************************************//*
+ * Returns the bucket of a (pict_id, resolution) key (FNV-1a).
+ */
+static uint32_t bucket_of(const char* pict_id, int resolution_code)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_PIC_ID && pict_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) pict_id[i];
+        hash *= 16777619u;
+    }
+    hash ^= (uint32_t) resolution_code;
+    hash *= 16777619u;
+    return hash % IMAGE_CACHE_BUCKETS;
+}
+
+/********************************************************************//*
+ * Returns the entry of a key, NULL if it is not cached.
+ */
+static struct cache_entry* find_entry(struct image_cache const* cache, const char* pict_id, int resolution_code)
+{
+    struct cache_entry* entry = cache->buckets[bucket_of(pict_id, resolution_code)];
+    while (entry != NULL && (entry->resolution_code != resolution_code
+                             || strncmp(entry->pict_id, pict_id, MAX_PIC_ID + 1) != 0)) {
+        entry = entry->bucket_next;
+    }
+    return entry;
+}
+
+/********************************************************************//*
+ * Takes an entry out of the LRU list.
+ */
+static void unlink_lru(struct image_cache* cache, struct cache_entry* entry)
+{
+    if (entry->more_recent != NULL) {
+        entry->more_recent->less_recent = entry->less_recent;
+    } else {
+        cache->most_recent = entry->less_recent;
+    }
+    if (entry->less_recent != NULL) {
+        entry->less_recent->more_recent = entry->more_recent;
+    } else {
+        cache->least_recent = entry->more_recent;
+    }
+    entry->more_recent = entry->less_recent = NULL;
+}
+
+/********************************************************************//*
+ * Puts an entry (out of the LRU list) at the most recent end of the list.
+ */
+static void push_most_recent(struct image_cache* cache, struct cache_entry* entry)
+{
+    entry->more_recent = NULL;
+    entry->less_recent = cache->most_recent;
+    if (cache->most_recent != NULL) {
+        cache->most_recent->more_recent = entry;
+    } else {
+        cache->least_recent = entry;
+    }
+    cache->most_recent = entry;
+}
+
+/********************************************************************//*
+ * Removes an entry from the cache and frees it.
+ */
+static void remove_entry(struct image_cache* cache, struct cache_entry* entry)
+{
+    struct cache_entry** link = &cache->buckets[bucket_of(entry->pict_id, entry->resolution_code)];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    unlink_lru(cache, entry);
+
+    cache->nb_bytes -= entry->image_size;
+    --cache->nb_entries;
+    free_the_buffer(&entry->image);
+    free(entry);
+}
+
+/********************************************************************//*
+ * Empties the cache if the database changed since its images were read.
+ * Returns 1 if db_version is older than the images of the cache (a thread
+ * which looked the database up before the last change), 0 otherwise.
+ */
+static int check_version(struct image_cache* cache, uint32_t db_version)
+{
+    if (db_version <= cache->db_version) {
+        return db_version < cache->db_version;
+    }
+    if (cache->nb_entries > 0) {
+        ++cache->invalidations;
+    }
+    while (cache->least_recent != NULL) {
+        remove_entry(cache, cache->least_recent);
+    }
+    cache->db_version = db_version;
+    return 0;
+}
+
+/********************************************************************//*
+ * Initializes an empty cache.
+ */
+void image_cache_init(struct image_cache* cache, uint64_t max_bytes)
+{
+    memset(cache, 0, sizeof(struct image_cache));
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->max_bytes = max_bytes;
+}
+
+/********************************************************************//*
+ * Frees all the cached images.
+ */
+void image_cache_free(struct image_cache* cache)
+{
+    pthread_mutex_lock(&cache->mutex);
+    while (cache->least_recent != NULL) {
+        remove_entry(cache, cache->least_recent);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+/********************************************************************//*
+ * Looks up an image and gives a copy of it.
+ */
+int image_cache_get(struct image_cache* cache, const char* pict_id, int resolution_code, uint32_t db_version,
+                    char** image_buffer, uint32_t* image_size)
+{
+    if (cache->max_bytes == 0) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    //a stale lookup is answered from the database, without emptying the cache
+    struct cache_entry* entry = NULL;
+    if (!check_version(cache, db_version)) {
+        entry = find_entry(cache, pict_id, resolution_code);
+    }
+    if (entry == NULL) {
+        ++cache->misses;
+        pthread_mutex_unlock(&cache->mutex);
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    char* copy = calloc(entry->image_size, sizeof(char));
+    if (copy == NULL) {
+        pthread_mutex_unlock(&cache->mutex);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(copy, entry->image, entry->image_size);
+    *image_buffer = copy;
+    *image_size = entry->image_size;
+    unlink_lru(cache, entry);
+    push_most_recent(cache, entry);
+    ++cache->hits;
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
+
+/********************************************************************//*
+ * Adds a copy of an image, evicting the least recently used ones.
+ */
+void image_cache_put(struct image_cache* cache, const char* pict_id, int resolution_code, uint32_t db_version,
+                     const char* image, uint32_t image_size)
+{
+    if (image_size == 0 || image_size > cache->max_bytes / IMAGE_CACHE_MAX_SHARE) {
+        return;
+    }
+
+    //the copy is made before taking the lock
+    struct cache_entry* entry = calloc(1, sizeof(struct cache_entry));
+    char* copy = calloc(image_size, sizeof(char));
+    if (entry == NULL || copy == NULL) {
+        free(entry);
+        free_the_buffer(&copy);
+        return;
+    }
+    memcpy(copy, image, image_size);
+    strncpy(entry->pict_id, pict_id, MAX_PIC_ID);
+    entry->resolution_code = resolution_code;
+    entry->image = copy;
+    entry->image_size = image_size;
+
+    pthread_mutex_lock(&cache->mutex);
+    if (check_version(cache, db_version)) {
+        //read before the last change of the database: it may already be stale
+        pthread_mutex_unlock(&cache->mutex);
+        free_the_buffer(&entry->image);
+        free(entry);
+        return;
+    }
+    struct cache_entry* old = find_entry(cache, pict_id, resolution_code);
+    if (old != NULL) {
+        //added by another thread in the meantime
+        remove_entry(cache, old);
+    }
+    while (cache->nb_bytes + image_size > cache->max_bytes && cache->least_recent != NULL) {
+        remove_entry(cache, cache->least_recent);
+        ++cache->evictions;
+    }
+
+    const uint32_t bucket = bucket_of(entry->pict_id, resolution_code);
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    push_most_recent(cache, entry);
+    cache->nb_bytes += image_size;
+    ++cache->nb_entries;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/********************************************************************//*
+ * Gives a snapshot of the counters of the cache.
+ */
+void image_cache_get_stats(struct image_cache* cache, struct image_cache_stats* stats)
+{
+    pthread_mutex_lock(&cache->mutex);
+    stats->max_bytes = cache->max_bytes;
+    stats->nb_bytes = cache->nb_bytes;
+    stats->nb_entries = cache->nb_entries;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->invalidations = cache->invalidations;
+    pthread_mutex_unlock(&cache->mutex);
+}
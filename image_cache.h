@@ -0,0 +1,118 @@
+/**
+ * @file image_cache.h
+ * @brief Header file for the in-memory cache of images of pictDB_server.
+ *
+ * The cache keeps copies of recently read images, keyed by (pict_id,
+ * resolution), within a budget of bytes: the least recently used images
+ * are evicted first. Every lookup and every addition gives the db_version
+ * of the database: when it is newer than the one of the cached images
+ * (insert, delete, resize, compaction), the whole cache is emptied, so
+ * that it never returns a stale image. An older db_version (a thread which
+ * looked the database up before the last change) leaves it untouched.
+ *
+ * All the functions are thread-safe.
+ *
+ * @author Cédric Viaccoz
+ * @author Matteo Giorla
+ * @date Jun 2016
+ */
+
+#ifndef PICTDBPRJ_IMAGE_CACHE_H
+#define PICTDBPRJ_IMAGE_CACHE_H
+
+#include "pictDB.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define IMAGE_CACHE_BUCKETS 1024
+#define IMAGE_CACHE_MAX_SHARE 8 // an image bigger than max_bytes / IMAGE_CACHE_MAX_SHARE is not cached
+
+struct cache_entry; // see image_cache.c
+
+/*! \struct image_cache
+    \brief LRU cache of images, with its hash table and its counters.
+*/
+struct image_cache {
+    pthread_mutex_t mutex;
+    uint64_t max_bytes;
+    uint64_t nb_bytes;
+    uint32_t nb_entries;
+    uint32_t db_version; // version of the database the entries were read from
+    struct cache_entry* buckets[IMAGE_CACHE_BUCKETS];
+    struct cache_entry* most_recent;
+    struct cache_entry* least_recent;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+/*! \struct image_cache_stats
+    \brief Snapshot of the counters of an image_cache.
+*/
+struct image_cache_stats {
+    uint64_t max_bytes;
+    uint64_t nb_bytes;
+    uint32_t nb_entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @param cache the cache to initialize.
+ * @param max_bytes the budget of bytes of the cached images (0: nothing is cached).
+ */
+void image_cache_init(struct image_cache* cache, uint64_t max_bytes);
+
+/**
+ * @brief Frees all the cached images.
+ *
+ * @param cache the cache to free.
+ */
+void image_cache_free(struct image_cache* cache);
+
+/**
+ * @brief Looks up an image and, if found, gives a copy of it (to be freed
+ *        with free_the_buffer) and makes it the most recently used.
+ *
+ * @param cache the cache.
+ * @param pict_id the id of the picture.
+ * @param resolution_code the resolution of the image.
+ * @param db_version the current version of the database.
+ * @param image_buffer where the copy of the image is stored.
+ * @param image_size where the size of the image is stored.
+ * @return 0 if the image was found, ERR_FILE_NOT_FOUND if not or if db_version
+ *         is older than the cached images, or another error code as defined in error.h.
+ */
+int image_cache_get(struct image_cache* cache, const char* pict_id, int resolution_code, uint32_t db_version,
+                    char** image_buffer, uint32_t* image_size);
+
+/**
+ * @brief Adds a copy of an image read from the database at version
+ *        db_version, evicting the least recently used images if needed.
+ *        Does nothing if the image is too big or if it was read from an older
+ *        version of the database than the cached images.
+ *
+ * @param cache the cache.
+ * @param pict_id the id of the picture.
+ * @param resolution_code the resolution of the image.
+ * @param db_version the version of the database the image was read from.
+ * @param image the image.
+ * @param image_size the size of the image.
+ */
+void image_cache_put(struct image_cache* cache, const char* pict_id, int resolution_code, uint32_t db_version,
+                     const char* image, uint32_t image_size);
+
+/**
+ * @brief Gives a snapshot of the counters of the cache.
+ *
+ * @param cache the cache.
+ * @param stats where the counters are copied.
+ */
+void image_cache_get_stats(struct image_cache* cache, struct image_cache_stats* stats);
+
+#endif
@@ -9,10 +9,28 @@
 
 #include "pictDB.h"
 #include "image_content.h"
+#include "db_index.h" //for index_ref_blob and the free extents
+#include "db_journal.h" //for journal_commit and journal_checkpoint
 
 #include <vips/vips.h>
+#include <stdint.h> // for uint32_t
 #include <stdlib.h>
 
+/* JPEG markers (second byte, after 0xFF) used to find the image dimensions */
+#define JPEG_SOF0  0xC0
+#define JPEG_DHT   0xC4
+#define JPEG_JPG   0xC8
+#define JPEG_DAC   0xCC
+#define JPEG_SOF15 0xCF
+#define JPEG_RST0  0xD0
+#define JPEG_RST7  0xD7
+#define JPEG_SOI   0xD8
+#define JPEG_EOI   0xD9
+#define JPEG_SOS   0xDA
+#define JPEG_TEM   0x01
+/* largest scaling done by the JPEG decoder (DCT domain): 1/8 */
+#define JPEG_MAX_SHRINK 8
+
 /********************************************************************//*
  * @brief Computes the shrinking factor (keeping aspect ratio)
  *
@@ -28,109 +46,330 @@ double shrink_value(VipsImage *image, int max_thumbnail_width, int max_thumbnail
 }
 
 /********************************************************************//*
- * Function used to create reduced images (in formats "small" and "thumbnail")
+ * Reads the dimensions of a JPEG image in its SOF (start of frame) segment,
+ * without decoding it. Returns 0 if they were found, -1 if the header is
+ * unusual (the caller then falls back to vips).
  */
-int lazily_resize(int resolution_code, struct pictdb_file* db_file, size_t index)
+static int jpeg_header_resolution(uint32_t* height, uint32_t* width, const unsigned char* jpeg, size_t size)
 {
-    //si la résolution donnée est la résolution originale, lazily_resize ne fait rien
-    if (resolution_code == RES_ORIG) {
-        return 0;
+    //une image JPEG commence par le marqueur SOI (FF D8)
+    if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != JPEG_SOI) {
+        return -1;
     }
-    //si la résolution passée en argument est invalide, la fonction retourne un code d'erreur
-    if (resolution_code != RES_THUMB && resolution_code != RES_SMALL) {
-        return ERR_RESOLUTIONS;
+
+    size_t pos = 2;
+    while (pos + 1 < size) {
+        if (jpeg[pos] != 0xFF) {
+            return -1;
+        }
+        //des octets FF de remplissage peuvent précéder le marqueur
+        while (pos + 1 < size && jpeg[pos + 1] == 0xFF) {
+            ++pos;
+        }
+        if (pos + 1 >= size) {
+            return -1;
+        }
+        const unsigned char marker = jpeg[pos + 1];
+        pos += 2;
+
+        //marqueurs sans segment
+        if (marker == JPEG_TEM || (marker >= JPEG_RST0 && marker <= JPEG_RST7)) {
+            continue;
+        }
+        //fin de l'image ou début des données compressées avant tout SOF
+        if (marker == JPEG_EOI || marker == JPEG_SOS || marker == JPEG_SOI) {
+            return -1;
+        }
+
+        if (pos + 2 > size) {
+            return -1;
+        }
+        const size_t length = ((size_t) jpeg[pos] << 8) | jpeg[pos + 1];
+        if (length < 2 || pos + length > size) {
+            return -1;
+        }
+
+        //SOF0 à SOF15, sauf DHT (C4), JPG (C8) et DAC (CC)
+        if (marker >= JPEG_SOF0 && marker <= JPEG_SOF15
+            && marker != JPEG_DHT && marker != JPEG_JPG && marker != JPEG_DAC) {
+            //longueur (2), précision (1), hauteur (2), largeur (2)
+            if (length < 7) {
+                return -1;
+            }
+            const uint32_t sof_height = ((uint32_t) jpeg[pos + 3] << 8) | jpeg[pos + 4];
+            const uint32_t sof_width = ((uint32_t) jpeg[pos + 5] << 8) | jpeg[pos + 6];
+            //une hauteur nulle est donnée plus loin (segment DNL) : cas laissé à vips
+            if (sof_height == 0 || sof_width == 0) {
+                return -1;
+            }
+            *height = sof_height;
+            *width = sof_width;
+            return 0;
+        }
+        pos += length;
     }
-    //si l'image demandée existe déjà dans la résolution demandée, la fonction ne fait rien
-    if (db_file->metadata[index].size[resolution_code] != 0) {
-        return 0;
+    return -1;
+}
+
+/********************************************************************//*
+ * Returns the largest JPEG shrink-on-load factor (1, 2, 4 or 8) such that
+ * the decoded image is still at least as large as the reduced variant
+ * (whose size is computed as in shrink_value), so that vips_resize only
+ * has a small reduction left to do.
+ */
+static int jpeg_load_shrink(const char* original_image, uint32_t original_size,
+                            uint16_t max_width, uint16_t max_height)
+{
+    uint32_t height = 0;
+    uint32_t width = 0;
+    if (jpeg_header_resolution(&height, &width, (const unsigned char*) original_image, original_size) != 0) {
+        //dimensions inconnues : décodage complet
+        return 1;
     }
 
-    //création d'une nouvelle image et ouverture de l'image originale dans l'image vips créée
-    VipsImage* original;
+    //dimensions finales de la variante réduite (même ratio que shrink_value)
+    const double h_shrink = (double) max_width / (double) width;
+    const double v_shrink = (double) max_height / (double) height;
+    const double ratio = h_shrink > v_shrink ? v_shrink : h_shrink;
 
-    uint32_t size_of_original = db_file->metadata[index].size[RES_ORIG];
-    void* image_memory = calloc(1, size_of_original);
+    int shrink = JPEG_MAX_SHRINK;
+    //l'image réduite par le décodeur (arrondie vers le haut) doit rester au moins aussi grande que la variante
+    while (shrink > 1 && ((width + shrink - 1) / shrink < width * ratio || (height + shrink - 1) / shrink < height * ratio)) {
+        shrink /= 2;
+    }
+    return shrink;
+}
 
-    int fseek_status = fseek(db_file->fpdb, db_file->metadata[index].offset[RES_ORIG], SEEK_SET);
-    if (fseek_status != 0) {
-        free_the_buffer((char**)&image_memory);
-        return ERR_IO;
+/********************************************************************//*
+ * Resizes image to fit in max_width x max_height (keeping aspect ratio)
+ * and encodes the result in jpeg in a new buffer. The resized vips image
+ * is given back too, so that a smaller variant can be derived from it.
+ */
+static int resize_and_save(VipsImage* image, uint16_t max_width, uint16_t max_height,
+                           VipsImage** resized, char** resized_image, size_t* resized_size)
+{
+    double ratio = shrink_value(image, max_width, max_height);
+    if (vips_resize(image, resized, ratio, NULL) != 0 || *resized == NULL) {
+        return ERR_VIPS;
     }
 
-    int num_read = fread(image_memory, db_file->metadata[index].size[RES_ORIG], 1, db_file->fpdb);
-    if (num_read != 1) {
-        free_the_buffer((char**)&image_memory);
-        return ERR_IO;
+    void* image_buffer = NULL;
+    size_t length = 0;
+    if (vips_jpegsave_buffer(*resized, &image_buffer, &length, NULL) != 0) {
+        return ERR_VIPS;
+    }
+    if (length > UINT32_MAX) {
+        free(image_buffer);
+        return ERR_VIPS;
     }
 
-    int loadStatus = vips_jpegload_buffer(image_memory, size_of_original, &original, NULL);
+    *resized_image = image_buffer;
+    *resized_size = length;
+    return 0;
+}
+
+/********************************************************************//*
+ * Creates the missing reduced variants of an original image, decoding it
+ * only once: the small image is made first and, when it is large enough,
+ * the thumbnail is derived from it (in memory) rather than from the original.
+ */
+int create_reduced_images(const char* original_image, uint32_t original_size, struct pictdb_header const* header,
+                          const int needed[RES_ORIG], char* resized_images[RES_ORIG], size_t resized_sizes[RES_ORIG])
+{
+    resized_images[RES_THUMB] = resized_images[RES_SMALL] = NULL;
+    resized_sizes[RES_THUMB] = resized_sizes[RES_SMALL] = 0;
+    if (!needed[RES_THUMB] && !needed[RES_SMALL]) {
+        return 0;
+    }
+
+    const uint16_t* thumb_res = header->res_resized[RES_THUMB];
+    const uint16_t* small_res = header->res_resized[RES_SMALL];
+    //la plus grande des variantes demandées est faite en premier, à partir de l'original
+    const int first = needed[RES_SMALL] ? RES_SMALL : RES_THUMB;
+    const int cascade = first == RES_SMALL && needed[RES_THUMB]
+                        && small_res[0] >= thumb_res[0] && small_res[1] >= thumb_res[1];
+
+    /*ouverture de l'image originale, réduite par le décodeur JPEG (shrink-on-load)
+    autant que le permettent toutes les variantes qui en seront tirées*/
+    int shrink = jpeg_load_shrink(original_image, original_size,
+                                  header->res_resized[first][0], header->res_resized[first][1]);
+    if (first == RES_SMALL && needed[RES_THUMB] && !cascade) {
+        const int thumb_shrink = jpeg_load_shrink(original_image, original_size, thumb_res[0], thumb_res[1]);
+        shrink = thumb_shrink < shrink ? thumb_shrink : shrink;
+    }
+    VipsImage* original = NULL;
+    int loadStatus = vips_jpegload_buffer((void*)original_image, original_size, &original, "shrink", shrink, NULL);
     if (loadStatus != 0) {
-        free_the_buffer((char**)&image_memory);
         return ERR_FILE_NOT_FOUND;
     }
     if (original == NULL) {
-        free_the_buffer((char**)&image_memory);
         return ERR_VIPS;
     }
 
-    //création de la nouvelle variante de l'image dans la résolution spécifiée
-    VipsObject* process = VIPS_OBJECT(vips_image_new());
+    VipsImage* first_image = NULL;
+    int status = resize_and_save(original, header->res_resized[first][0], header->res_resized[first][1],
+                                 &first_image, &resized_images[first], &resized_sizes[first]);
+
+    if (!status && first == RES_SMALL && needed[RES_THUMB]) {
+        //la miniature est tirée de la petite image déjà décodée (cascade), sinon de l'original
+        VipsImage* source = cascade ? first_image : original;
+        VipsImage* thumb_image = NULL;
+        status = resize_and_save(source, thumb_res[0], thumb_res[1],
+                                 &thumb_image, &resized_images[RES_THUMB], &resized_sizes[RES_THUMB]);
+        if (thumb_image != NULL) {
+            g_object_unref(thumb_image);
+        }
+    }
+
+    if (first_image != NULL) {
+        g_object_unref(first_image);
+    }
+    g_object_unref(original);
 
-    VipsImage** resized = (VipsImage**) vips_object_local_array(process, 1);
+    if (status) {
+        free_the_buffer(&resized_images[RES_THUMB]);
+        free_the_buffer(&resized_images[RES_SMALL]);
+        resized_sizes[RES_THUMB] = resized_sizes[RES_SMALL] = 0;
+    }
+    return status;
+}
 
-    double ratio = shrink_value(original, db_file->header.res_resized[resolution_code][0], db_file->header.res_resized[resolution_code][1]);
+/********************************************************************//*
+ * Stores the given reduced images in free extents of the database file
+ * (or at its end) and references them in the metadata, with a single
+ * metadata write.
+ */
+int store_reduced_images(struct pictdb_file* db_file, size_t index,
+                         char* const resized_images[RES_ORIG], const size_t resized_sizes[RES_ORIG])
+{
+    int fseek_status = fseek(db_file->fpdb, 0, SEEK_END);
+    if (fseek_status != 0) {
+        return ERR_IO;
+    }
 
-    vips_resize(original, resized, ratio, NULL);
+    long end_of_file = ftell(db_file->fpdb);
+    if (end_of_file < 0) {
+        return ERR_IO;
+    }
+    uint64_t end = end_of_file;
 
-    size_t* length = calloc(sizeof(size_t), 1);
-    if(length == NULL) {
-        void * nullpointer = NULL; //to use pointer_liberation without having an image buffer initialized.
-        pointer_liberation(&original, &image_memory, &length, &nullpointer, &process);
-        return ERR_OUT_OF_MEMORY;
+    //copie du contenu des images dans les places libres les plus ajustées, sinon à la fin du fichier pictDB
+    struct pict_metadata updated = db_file->metadata[index];
+    for (int res = RES_THUMB; res < RES_ORIG; ++res) {
+        if (resized_images[res] == NULL) {
+            continue;
+        }
+        uint64_t offset = 0;
+        int alloc_status = index_alloc_extent(db_file, resized_sizes[res], &offset);
+        if (alloc_status) {
+            return alloc_status;
+        }
+        const int in_hole = offset != 0;
+        if (!in_hole) {
+            offset = end;
+        }
+        if (fseek(db_file->fpdb, offset, SEEK_SET) != 0
+            || fwrite(resized_images[res], resized_sizes[res], 1, db_file->fpdb) != 1) {
+            if (in_hole) {
+                //l'erreur d'écriture prime : une place qui n'a pu être rendue est retrouvée à la prochaine ouverture
+                index_free_extent(db_file, offset, resized_sizes[res]);
+            }
+            return ERR_IO;
+        }
+        if (!in_hole) {
+            end += resized_sizes[res];
+        }
+        updated.offset[res] = offset; //endroit où l'image réduite est stockée
+        updated.size[res] = resized_sizes[res]; //taille de l'image réduite
     }
 
-    uint32_t size_of_resized = db_file->metadata[index].size[resolution_code];
-    void* image_buffer = calloc(1, size_of_resized);
+    //mise à jour des metadatas en mémoire, une fois les images écrites
+    for (int res = RES_THUMB; res < RES_ORIG; ++res) {
+        if (resized_images[res] == NULL) {
+            continue;
+        }
+        if (db_file->metadata[index].size[res] != 0) {
+            //l'image remplacée perd sa référence
+            int unref_status = index_unref_blob(db_file, db_file->metadata[index].offset[res]);
+            if (unref_status) {
+                return unref_status;
+            }
+        }
+        int ref_status = index_ref_blob(db_file, updated.offset[res], updated.size[res]);
+        if (ref_status) {
+            return ref_status;
+        }
+    }
+    db_file->metadata[index] = updated;
 
-    int saveStatus = vips_jpegsave_buffer(*resized, &image_buffer, length, NULL);
-    if (saveStatus != 0) {
-        pointer_liberation(&original, &image_memory, &length, &image_buffer, &process);
-        return ERR_VIPS;
+    //mise à jour des metadatas sur le disque (enregistrée d'abord dans le journal, s'il y en a un)
+    int journal_status = journal_commit(db_file, index, index);
+    if (journal_status) {
+        return journal_status;
+    }
+    int write_status = write_metadata_range(db_file, index, index);
+    if (write_status) {
+        return write_status;
     }
-    uint32_t size_for_metadata = *length;
+    return journal_checkpoint(db_file);
+}
 
-    //copie du contenu de l'image à la fin du fichier pictDB
-    fseek_status = fseek(db_file->fpdb, 0, SEEK_END);
-    if (fseek_status != 0) {
-        pointer_liberation(&original, &image_memory, &length, &image_buffer, &process);
-        return ERR_IO;
+/********************************************************************//*
+ * Function used to create reduced images (in formats "small" and "thumbnail")
+ */
+int lazily_resize(int resolution_code, struct pictdb_file* db_file, size_t index)
+{
+    //si la résolution donnée est la résolution originale, lazily_resize ne fait rien
+    if (resolution_code == RES_ORIG) {
+        return 0;
+    }
+    //si la résolution passée en argument est invalide, la fonction retourne un code d'erreur
+    if (resolution_code != RES_THUMB && resolution_code != RES_SMALL) {
+        return ERR_RESOLUTIONS;
+    }
+    //si l'image demandée existe déjà dans la résolution demandée, la fonction ne fait rien
+    if (db_file->metadata[index].size[resolution_code] != 0) {
+        return 0;
     }
 
-    uint64_t offset_for_metadata = ftell(db_file->fpdb);
+    //lecture de l'image originale
+    uint32_t size_of_original = db_file->metadata[index].size[RES_ORIG];
+    char* image_memory = calloc(1, size_of_original);
+    if (image_memory == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
 
-    int written = fwrite(image_buffer, size_for_metadata, 1, db_file->fpdb);
-    if (written != 1) {
-        pointer_liberation(&original, &image_memory, &length, &image_buffer, &process);
+    int fseek_status = fseek(db_file->fpdb, db_file->metadata[index].offset[RES_ORIG], SEEK_SET);
+    if (fseek_status != 0) {
+        free_the_buffer(&image_memory);
         return ERR_IO;
     }
 
-    //libération des pointeurs
-    pointer_liberation(&original, &image_memory, &length, &image_buffer, &process);
-    //mise à jour des metadatas en mémoire
-    db_file->metadata[index].offset[resolution_code] = offset_for_metadata; //endroit où l'image réduite est stockée
-    db_file->metadata[index].size[resolution_code] = size_for_metadata; //taille de l'image réduite
+    int num_read = fread(image_memory, db_file->metadata[index].size[RES_ORIG], 1, db_file->fpdb);
+    if (num_read != 1) {
+        free_the_buffer(&image_memory);
+        return ERR_IO;
+    }
 
-    //mise à jour des metadatas sur le disque
-    //positionnement
-    long initial_offset_for_metadata = sizeof(struct pictdb_header) + index * sizeof(struct pict_metadata);
-    fseek_status = fseek(db_file->fpdb, initial_offset_for_metadata, SEEK_SET); //on se place au bon pictID dans la metadata
-    if (fseek_status != 0) return ERR_IO;
+    //l'autre variante réduite, si elle manque aussi, est créée avec le même décodage de l'original
+    int needed[RES_ORIG];
+    needed[RES_THUMB] = db_file->metadata[index].size[RES_THUMB] == 0;
+    needed[RES_SMALL] = db_file->metadata[index].size[RES_SMALL] == 0;
 
-    //écriture
-    int num_written = fwrite(&db_file->metadata[index], sizeof(struct pict_metadata), 1, db_file->fpdb);
-    if (num_written != 1) return ERR_IO;
+    //création des variantes réduites, puis écriture dans la base
+    char* resized_images[RES_ORIG];
+    size_t resized_sizes[RES_ORIG];
+    int resize_status = create_reduced_images(image_memory, size_of_original, &db_file->header, needed,
+                                              resized_images, resized_sizes);
+    free_the_buffer(&image_memory);
+    if (resize_status) {
+        return resize_status;
+    }
 
-    return 0;
+    int store_status = store_reduced_images(db_file, index, resized_images, resized_sizes);
+    free_the_buffer(&resized_images[RES_THUMB]);
+    free_the_buffer(&resized_images[RES_SMALL]);
+    return store_status;
 }
 
 /********************************************************************//*
@@ -138,17 +377,23 @@ int lazily_resize(int resolution_code, struct pictdb_file* db_file, size_t index
  */
 int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer , size_t image_size)
 {
-    //création d'une nouvelle image et ouverture de l'image donnée dans l'image vips créée
-    VipsImage* vips_image;
+    //lecture directe des dimensions dans l'en-tête JPEG, sans décoder l'image
+    if (jpeg_header_resolution(height, width, (const unsigned char*) image_buffer, image_size) == 0) {
+        return 0;
+    }
+
+    //fichier inhabituel : création d'une nouvelle image et ouverture de l'image donnée dans l'image vips créée
+    VipsImage* vips_image = NULL;
 
     int loadStatus = vips_jpegload_buffer((void*)image_buffer, image_size, &vips_image, NULL);
-    if (loadStatus != 0) {
+    if (loadStatus != 0 || vips_image == NULL) {
         return ERR_VIPS;
     }
 
     *height = vips_image_get_height(vips_image);
     *width = vips_image_get_width(vips_image);
 
+    g_object_unref(vips_image);
     return 0;
 }
 
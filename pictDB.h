@@ -11,6 +11,13 @@
  * because it should be stored as raw bytes appended at the end of the
  * database file and addressed by offsets in the metadata structure.
  *
+ * From format version 1 (low bits of pictdb_header.unused_32, whose high
+ * bits hold the options of the database), the metadata table can
+ * grow: pictdb_header.unused_64 is then the position of a first chunk of
+ * additional metadata (a metadata_chunk_header followed by its metadata
+ * structures), itself linked to the next one. Chunks are appended to the
+ * file like images and never move.
+ *
  * @author Mia Primorac
  *
  * @author Cédric Viaccoz
@@ -33,7 +40,8 @@
 /* constraints */
 #define MAX_DB_NAME 31  // max. size of a PictDB name
 #define MAX_PIC_ID 127  // max. size of a picture id
-#define MAX_MAX_FILES 100000
+#define MAX_MAX_FILES 100000 // max. size of the metadata array following the header
+#define MAX_TOTAL_FILES (1 << 26) // max. number of metadata, with the chunks of format 1
 #define MAX_THUMB_RES 128
 #define MAX_SMALL_RES 512
 /* For is_valid in pictdb_metadata */
@@ -47,6 +55,20 @@
 #define NB_RES    3
 
 #define EXTENSION ".pictDB"
+
+/* On-disk format versions (low 16 bits of pictdb_header.unused_32) */
+#define PICTDB_FORMAT_LEGACY 0 // fixed metadata array only
+#define PICTDB_FORMAT_CHUNKED 1 // unused_64: position of the first metadata chunk (0: none)
+#define PICTDB_FORMAT_CURRENT PICTDB_FORMAT_CHUNKED
+#define PICTDB_FORMAT_MASK 0xFFFFu
+#define PICTDB_FORMAT(header) ((header).unused_32 & PICTDB_FORMAT_MASK)
+/* Options of a database (high 16 bits of pictdb_header.unused_32) */
+#define PICTDB_FLAGS_MASK 0xFFFF0000u
+#define PICTDB_FLAG_EAGER_RESIZE (1u << 16) // the reduced images are made when inserting
+#define METADATA_CHUNK_MAGIC "PDBCHNK" // 7 characters + '\0'
+#define METADATA_CHUNK_MIN 1024 // min. number of metadata added when a database grows
+#define METADATA_CHUNK_MAX (1 << 20) // max. number of metadata added at once
+#define MAX_PROBE_THREADS 32 // max. number of threads of do_insert_batch_parallel
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -94,18 +116,115 @@ struct pict_metadata {
     uint16_t unused_16;
 };
 
+/*! \struct metadata_chunk_header
+    \brief Struct représentant l'en-tête d'un bloc de metadata supplémentaires (format 1).
+
+ Il est suivi sur le disque de nb_slots struct pict_metadata ; next_chunk est la
+ position du bloc suivant dans le fichier (0 pour le dernier).
+*/
+struct metadata_chunk_header {
+    char magic[8]; // METADATA_CHUNK_MAGIC
+    uint32_t nb_slots;
+    uint32_t unused_32;
+    uint64_t next_chunk;
+};
+
+struct pictdb_index; // in-memory lookup structures, see db_index.h
+
+/*! \struct insert_item
+    \brief Struct représentant une image à insérer par do_insert_batch.
+
+ L'appelant fournit l'image, sa taille et son identificateur ; do_insert_batch
+ indique pour chaque image le résultat de son insertion et l'entrée de la metadata utilisée.
+ Le SHA et la résolution sont calculés par do_insert_batch (ou ses threads d'analyse),
+ ainsi que les images réduites si eager est non nul ou si la base a l'option PICTDB_FLAG_EAGER_RESIZE.
+*/
+struct insert_item {
+    const char* image;
+    size_t image_size;
+    const char* pict_id;
+    int status; // code d'erreur de l'insertion de cette image (0 si elle a été insérée)
+    int slot; // entrée de la metadata de l'image insérée, -1 sinon
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[2];
+    int eager; // crée les images réduites à l'insertion (comme PICTDB_FLAG_EAGER_RESIZE)
+    char* reduced[RES_ORIG]; // images réduites créées à l'analyse (NULL sinon)
+    size_t reduced_sizes[RES_ORIG];
+};
+
 /*! \struct pictdb_file
     \brief Struct représentant une base de données d'images.
 
  Struct pour les files, comprenant un pointeur sur le fichier de la DataBase,
- les informations générales sous forme d'un header et un tableau de metadata.
+ les informations générales sous forme d'un header et un tableau de metadata,
+ ainsi que l'index en mémoire construit à partir de ces metadata.
 */
 struct pictdb_file {
     FILE* fpdb;
     struct pictdb_header header;
     struct pict_metadata * metadata;
+    struct pictdb_index * index;
 };
 
+/*! \struct pictdb_stats
+    \brief Struct représentant l'occupation du fichier d'une base de données.
+
+ Les octets vivants sont ceux des images référencées par au moins une entrée
+ valide (une image partagée par déduplication n'est comptée qu'une fois) ;
+ les octets morts sont les autres octets après les metadata, récupérables par gc.
+*/
+struct pictdb_stats {
+    uint64_t file_size;
+    uint64_t metadata_bytes; // header et tableau des metadata
+    uint64_t live_bytes;
+    uint64_t dead_bytes;
+    double fragmentation; // part des octets morts dans la zone des images, en %
+    uint32_t nb_blobs; // images distinctes stockées
+    uint32_t nb_shared_blobs; // images référencées par plusieurs entrées
+    uint64_t nb_references;
+    uint32_t nb_holes; // zones mortes entre les images (et en fin de fichier)
+    uint64_t largest_hole;
+};
+
+/**
+ * @brief Returns the total number of metadata entries of an opened database
+ *        (max_files, plus the entries of the chunks of a format 1 database).
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @return the number of entries of the metadata array.
+ */
+uint32_t db_capacity(struct pictdb_file const* db_file);
+
+/**
+ * @brief Returns the position in the file of a metadata entry.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param slot the index of the entry in the metadata array.
+ * @return the offset of the entry in the database file.
+ */
+uint64_t metadata_position(struct pictdb_file const* db_file, uint32_t slot);
+
+/**
+ * @brief Writes the metadata entries first to last (included) at their place
+ *        in the file, with one write per contiguous part of the range.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param first the first entry to write.
+ * @param last the last entry to write.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int write_metadata_range(struct pictdb_file* db_file, uint32_t first, uint32_t last);
+
+/**
+ * @brief Adds a chunk of nb_slots empty metadata entries to a format 1 database:
+ *        the chunk is appended to the file, then linked to the previous one.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param nb_slots the number of entries to add.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t nb_slots);
+
 /**
  * @brief Prints database header informations.
  *
@@ -113,6 +232,14 @@ struct pictdb_file {
  */
 void print_header(struct pictdb_header const* header);
 
+/**
+ * @brief Prints the occupancy of the metadata slots (free and used),
+ *        as maintained by the in-memory index.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ */
+void print_occupancy(struct pictdb_file const* db_file);
+
 /**
  * @brief Prints picture metadata informations.
  *
@@ -169,6 +296,22 @@ int do_open(const char* file_name, const char* open_mode, struct pictdb_file* co
  */
 void do_close(struct pictdb_file* const pict_file);
 
+/**
+ * @brief Builds the in-memory index (pict_id -> metadata slot) of a pictDB
+ *        whose header and metadata are already loaded.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int build_index(struct pictdb_file* db_file);
+
+/**
+ * @brief Frees the in-memory index of a pictDB (does nothing if there is none).
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ */
+void free_index(struct pictdb_file* db_file);
+
 /**
  * @brief Transforms a resolution given in form of a character string into the right resolution code
  *
@@ -191,7 +334,105 @@ int resolution_atoi(const char* const resolution);
 int do_read(const char* pict_id, const int resolution_code, char** image_buffer, uint32_t * const image_size, struct pictdb_file * const db_file);
 
 /**
- * @brief Inserts image in image database
+ * @brief Locates an image in the database file (creating the resolution if it
+ *        doesn't exist yet) without reading it, e.g. to stream it from the file.
+ *
+ * @param pict_id name of the picture to find in the db
+ * @param resolution_code the resolution wanted (thumbnail, small or original)
+ * @param offset adress where the position of the image in the file will be stocked
+ * @param image_size adress where the size of the image found will be stocked
+ * @param db_file the database to seek the image metadata
+ *
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int do_locate(const char* pict_id, const int resolution_code, uint64_t * const offset, uint32_t * const image_size, struct pictdb_file * const db_file);
+
+/**
+ * @brief Reads bytes of the database file in a new buffer with pread, i.e. without
+ *        moving the FILE position, so that several threads can read concurrently.
+ *        Data written through fpdb must have been fflush'ed before.
+ *
+ * @param db_file the database to read from
+ * @param offset the position of the data in the file
+ * @param size the number of bytes to read
+ * @param image_buffer adress where the new buffer will be stocked
+ *
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int read_image_at(struct pictdb_file const* db_file, uint64_t offset, uint32_t size, char** image_buffer);
+
+/**
+ * @brief Creates the missing reduced variants (thumb and/or small) of an original
+ *        image, decoding it only once: when both are needed, the thumbnail is
+ *        derived from the in-memory small image. Does not access the database file.
+ *
+ * @param original_image the original image, in jpeg
+ * @param original_size the size of the original image
+ * @param header the header of the database, giving the reduced resolutions
+ * @param needed needed[RES_THUMB] and needed[RES_SMALL] tell which variants to create
+ * @param resized_images where the new buffers are stocked (NULL for the variants not created)
+ * @param resized_sizes where the sizes of the reduced images are stocked
+ *
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int create_reduced_images(const char* original_image, uint32_t original_size, struct pictdb_header const* header,
+                          const int needed[RES_ORIG], char* resized_images[RES_ORIG], size_t resized_sizes[RES_ORIG]);
+
+/**
+ * @brief Stores reduced images (made by create_reduced_images) in the free extents of
+ *        the database file (best fit) or at its end, and references them in the metadata
+ *        of the picture, with a single metadata write.
+ *
+ * @param db_file the database the picture belongs to
+ * @param index the index of the picture in the metadata array
+ * @param resized_images the reduced images, indexed by resolution (NULL: nothing to store)
+ * @param resized_sizes the sizes of the reduced images
+ *
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int store_reduced_images(struct pictdb_file* db_file, size_t index,
+                         char* const resized_images[RES_ORIG], const size_t resized_sizes[RES_ORIG]);
+
+/**
+ * @brief Opens the database file in read-only memory-mapped mode: the header,
+ *        the metadata array and the images are accessed directly from the mapping.
+ *        The index is loaded from the index file of the database when it is up to
+ *        date: only the metadata pages touched by the lookups are read. Otherwise,
+ *        the complete index is built and saved.
+ *        Such a database only supports do_read_view and must be closed with do_close_mmap.
+ *
+ * @param file_name the name of the file wanted to be open.
+ * @param pict_file the struct where the header, metadata and index are stocked.
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int do_open_paged(const char* file_name, struct pictdb_file* const pict_file);
+
+/**
+ * @brief Unmaps and closes a database opened with do_open_paged.
+ *
+ * @param pict_file In memory structure with header, metadata and index.
+ */
+void do_close_mmap(struct pictdb_file* const pict_file);
+
+/**
+ * @brief Gives a view on an image of a memory-mapped database, without copying it.
+ *        The resolution must already exist (use do_read to create it).
+ *
+ * @param pict_id name of the picture to find in the db
+ * @param resolution_code tells in what resolution we want to read the image (thumbnail, small or original)
+ * @param image adress where the pointer to the image in the mapping will be stocked
+ * @param image_size adress where the size of the image found will be stocked
+ * @param db_file the database opened with do_open_paged
+ *
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int do_read_view(const char* pict_id, const int resolution_code, const char** image, uint32_t* const image_size,
+                 struct pictdb_file const* db_file);
+
+/**
+ * @brief Inserts image in image database. If the database has the
+ *        PICTDB_FLAG_EAGER_RESIZE option, its thumbnail and small images are
+ *        made and written at the same time (else they are made later).
  *
  * @param image the image to insert into the database
  * @param image_size the size of the image to insert
@@ -202,6 +443,36 @@ int do_read(const char* pict_id, const int resolution_code, char** image_buffer,
  */
 int do_insert(const char* const image, size_t image_size, char* pict_id, struct pictdb_file* db_file);
 
+/**
+ * @brief Inserts several images in image database: the images which do not
+ *        fit in a free extent are appended one after the other at the end of
+ *        the file, and the metadata range
+ *        modified and the header are written only once, at the end of the batch.
+ *
+ * @param items the images to insert; the status (and slot) of each one is filled in
+ * @param nb_items the number of images to insert
+ * @param db_file the database file into which the images have to be inserted
+ *
+ * @return error code as defined in error.h if the batch could not be written,
+ *         0 otherwise (images rejected, e.g. duplicates, only have their own status set).
+ */
+int do_insert_batch(struct insert_item* items, size_t nb_items, struct pictdb_file* db_file);
+
+/**
+ * @brief Same as do_insert_batch, but the SHA and the resolution of the images
+ *        (and their reduced images in eager mode) are computed by a pool of threads while the calling thread, the only
+ *        one writing in the database file, appends the images already probed.
+ *
+ * @param items the images to insert; the status (and slot) of each one is filled in
+ * @param nb_items the number of images to insert
+ * @param db_file the database file into which the images have to be inserted
+ * @param nb_threads the number of probing threads (at most MAX_PROBE_THREADS, 0 or 1: none)
+ *
+ * @return error code as defined in error.h if the batch could not be written, 0 otherwise.
+ */
+int do_insert_batch_parallel(struct insert_item* items, size_t nb_items, struct pictdb_file* db_file,
+                             unsigned int nb_threads);
+
 /**
  * @brief Performs garbage collecting on pictDB.
  *
@@ -213,6 +484,43 @@ int do_insert(const char* const image, size_t image_size, char* pict_id, struct
  */
  int do_gbcollect(struct pictdb_file* db_file, char const* orig_file_name, char* tmp_file_name);
 
+/**
+ * @brief Performs one bounded step of incremental (online) compaction: live
+ *        images are moved, from the end of the file, into the holes left by
+ *        deleted pictures, their offsets are updated in place and the file is
+ *        truncated after the last live image. Pinned images (see
+ *        index_pin_blob) stay in place until a later step. Needs the
+ *        in-memory index.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param max_bytes the maximum number of bytes to move during this step
+ *        (at least one image is moved if possible)
+ * @param moved_bytes where the number of bytes moved is stocked
+ * @param finished set to 1 when nothing can be moved any more (0 while a
+ *        pinned image waits to be moved or truncated)
+ *
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int do_compact_step(struct pictdb_file* db_file, uint64_t max_bytes, uint64_t* moved_bytes, int* finished);
+
+/**
+ * @brief Computes the space usage of a database (live and dead bytes,
+ *        fragmentation), from the reference counts of its in-memory index.
+ *
+ * @param db_file In memory structure with header, metadata and index.
+ * @param stats where the results are stocked
+ *
+ * @return error code as defined in error.h if anything went wrong, 0 otherwise.
+ */
+int do_stats(struct pictdb_file const* db_file, struct pictdb_stats* stats);
+
+/**
+ * @brief Prints the space usage of a database.
+ *
+ * @param stats the results of do_stats
+ */
+void print_stats(struct pictdb_stats const* stats);
+
 /**
  * @brief Read an image from the disk to store it in the DB
  *
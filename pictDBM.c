@@ -10,21 +10,36 @@
  * @author Matteo Giorla
  * @date 21 Mar 2016
  */
+#define _POSIX_C_SOURCE 200809L // for opendir and stat with -std=c99
+
 #include <vips/vips.h> //for VIPS_INIT
 
 #include "pictDB.h"
 #include "pictDBM_tools.h"
+#include "db_journal.h" //for journal_open and JOURNAL_EXTENSION
 
+#include <dirent.h> // for opendir, readdir
+#include <inttypes.h> // for PRIu64
 #include <stdlib.h>
 #include <string.h>
-#define MAX_COMMANDS 7 //we can alter this macro according to when new comands are added to the program.
+#include <sys/stat.h> // for stat
+#define MAX_COMMANDS 10 //we can alter this macro according to when new comands are added to the program.
 //macros to match the optional arguments of the "create" command.
 #define MF_ARGUMENT "-max_files"
 #define TR_ARGUMENT "-thumb_res"
 #define SR_ARGUMENT "-small_res"
+#define ER_ARGUMENT "-eager_resize"
 #define MF_DEFAULT 10
 #define TR_DEFAULT 64
 #define SR_DEFAULT 256
+//limits of one batch of insert-batch (one metadata/header write per batch).
+#define BATCH_MAX_IMAGES 256
+#define BATCH_MAX_BYTES (64 * 1024 * 1024)
+#define MANIFEST_LINE_MAX 4096
+#define THREADS_ARGUMENT "-threads"
+//maximum number of bytes moved by each step of the "compact" command.
+#define STEP_ARGUMENT "-step"
+#define STEP_DEFAULT (4 * 1024 * 1024)
 
 
 /* déclaration du type command, qui est un pointeur sur
@@ -32,6 +47,38 @@ les différentes fonctions appelées par la ligne de commande*/
 typedef int (*command)(int args, char* argvs[]);
 
 
+/********************************************************************//**
+ * Opens pictDB file, builds its in-memory index and attaches its journal
+ * (an interrupted update is replayed first).
+ ********************************************************************** */
+static int
+open_db(const char* file_name, const char* open_mode, struct pictdb_file* pictdb_file)
+{
+    //l'index n'existe pas encore, close_db doit pouvoir être appelé même en cas d'erreur
+    pictdb_file->index = NULL;
+
+    int openStatus = do_open(file_name, open_mode, pictdb_file);
+    if (openStatus) {
+        return openStatus;
+    }
+    int indexStatus = build_index(pictdb_file);
+    if (indexStatus) {
+        return indexStatus;
+    }
+    return journal_open(pictdb_file, file_name);
+}
+
+/********************************************************************//**
+ * Frees the in-memory index and closes pictDB file.
+ ********************************************************************** */
+static void
+close_db(struct pictdb_file* pictdb_file)
+{
+    free_index(pictdb_file);
+    do_close(pictdb_file);
+}
+
+
 /********************************************************************//**
  * Opens pictDB file and calls do_list command.
  ********************************************************************** */
@@ -43,7 +90,7 @@ do_list_cmd (int args, char *argv[])
     }
     struct pictdb_file myfile;
 
-    int openStatus = do_open(argv[1], "r+b", &myfile);
+    int openStatus = open_db(argv[1], "r+b", &myfile);
     //traitement de l'erreur renvoyée par do_open
     if (openStatus) {
         return openStatus;
@@ -51,10 +98,37 @@ do_list_cmd (int args, char *argv[])
 
     do_list(&myfile, STDOUT);
 
-    do_close(&myfile);
+    close_db(&myfile);
     return 0;
 }
 
+/********************************************************************//**
+ * Opens pictDB file and displays its space usage.
+ ********************************************************************** */
+int
+do_stats_cmd (int args, char *argv[])
+{
+    if (args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    struct pictdb_file myfile;
+
+    int openStatus = open_db(argv[1], "r+b", &myfile);
+    if (openStatus) {
+        close_db(&myfile);
+        return openStatus;
+    }
+
+    struct pictdb_stats stats;
+    int statsStatus = do_stats(&myfile, &stats);
+    if (!statsStatus) {
+        print_stats(&stats);
+    }
+
+    close_db(&myfile);
+    return statsStatus;
+}
+
 /********************************************************************//**
  * Prepares and calls do_create command.
 ********************************************************************** */
@@ -71,6 +145,7 @@ do_create_cmd (int args, char *argv[])
     uint16_t thumb_resY =  TR_DEFAULT;
     uint16_t small_resX = SR_DEFAULT;
     uint16_t small_resY = SR_DEFAULT;
+    int eager_resize = 0;
     //save and test the obligatory argument here.
     const char* dbfilename = argv[1];
     if(dbfilename == NULL) {
@@ -115,6 +190,8 @@ do_create_cmd (int args, char *argv[])
             } else {
                 return ERR_NOT_ENOUGH_ARGUMENTS;
             }
+        } else if(strncmp(argv[i], ER_ARGUMENT, strlen(ER_ARGUMENT) + 1) == 0) {
+            eager_resize = 1;
         } else {
             //the argument did not match any of the tree possibilities, so we return an error.
             return ERR_INVALID_ARGUMENT;
@@ -129,13 +206,19 @@ do_create_cmd (int args, char *argv[])
     pictdb_file.header.res_resized[0][1] = thumb_resY;
     pictdb_file.header.res_resized[1][0] = small_resX;
     pictdb_file.header.res_resized[1][1] = small_resY;
+    //options de la base (do_create y ajoute la version du format)
+    pictdb_file.header.unused_32 = eager_resize ? PICTDB_FLAG_EAGER_RESIZE : 0;
 
     int errorStatus = do_create(&pictdb_file, dbfilename); //pour que do_create_cmd retourne le code d'erreur retourné par do_create
     if(pictdb_file.fpdb != NULL) {
         fclose(pictdb_file.fpdb); //On doit fermer le FILE ici puisqu'on ne le fait plus dans create.
     }
+    free_index(&pictdb_file);
     //affichage informatif du header
     print_header(&pictdb_file.header);
+    if(errorStatus == 0) {
+        print_occupancy(&pictdb_file);
+    }
     //on doit ensuite libérer la mémoire occupée sur la RAM par les metadata.
     if(pictdb_file.metadata != NULL) {
         free(pictdb_file.metadata);
@@ -154,6 +237,7 @@ help (int args, char *argv[])
     printf("pictDBM [COMMAND] [ARGUMENTS]\n");
     printf("  help: displays this help.\n");
     printf("  list <dbfilename>: list pictDB content.\n");
+    printf("  stats <dbfilename>: show live and dead bytes and the fragmentation of pictDB.\n");
     printf("  create <dbfilename> [options]: create a new pictDB.\n");
     printf("      options are:\n");
     printf("          -max_files <MAX_FILES>: maximum number of files.\n");
@@ -165,13 +249,20 @@ help (int args, char *argv[])
     printf("          -small_res <X_RES> <Y_RES>: resolution for small images.\n");
     printf("                                  default value is 256x256\n");
     printf("                                  maximum value is 512x512\n");
+    printf("          -eager_resize: make the thumbnail and small images when inserting.\n");
     printf("  delete <dbfilename> <pictID>: delete picture pictID from pictDB.\n");
     printf("  read <dbfilename> <pictID> [original|orig|thumbnail|thumb|small]:\n");
     printf("      read an image from the pictDB and save it to a file.\n");
     printf("  default resolution is \"original\".\n");
     printf("  insert <dbfilename> <pictID> <filename>: insert a new image in the pictDB.\n");
     printf("  delete <dbfilename> <pictID>: delete picture pictID from pictDB.\n");
+    printf("  insert-batch <dbfilename> <directory|manifest> [-threads <N>]: insert many images in the pictDB.\n");
+    printf("      a directory: every file is inserted, its name without extension is the pictID.\n");
+    printf("      a manifest: text file with one \"<pictID> <filename>\" per line.\n");
+    printf("      -threads <N>: hash and probe the images with N threads (max 32) while one thread writes.\n");
     printf("  gc <dbfilename> <tmp dbfilename>: performs garbage collecting on pictDB. Requires a temporary filename for copying the pictDB.\n");
+    printf("  compact <dbfilename> [-step <BYTES>]: reclaims the space of deleted pictures in place, by steps.\n");
+    printf("      -step <BYTES>: maximum number of bytes moved by each step (default 4 MiB).\n");
     return 0;
 }
 
@@ -192,9 +283,9 @@ do_delete_cmd (int args, char *argv[])
 
     //ouverture du fichier
     struct pictdb_file pictdb_file;
-    int openStatus = do_open(argv[1], "r+b", &pictdb_file);
+    int openStatus = open_db(argv[1], "r+b", &pictdb_file);
     if (openStatus != 0) {
-        do_close(&pictdb_file);
+        close_db(&pictdb_file);
         return openStatus;
     }
 
@@ -202,7 +293,7 @@ do_delete_cmd (int args, char *argv[])
     int deleteStatus = do_delete(argv[2], &pictdb_file);
 
     //fermeture du fichier
-    do_close(&pictdb_file);
+    close_db(&pictdb_file);
 
     return deleteStatus;
 }
@@ -223,22 +314,23 @@ do_insert_cmd (int args, char *argv[])
     }
 
     struct pictdb_file pictdb_file;
-    int openStatus = do_open(argv[1], "r+b", &pictdb_file);
+    int openStatus = open_db(argv[1], "r+b", &pictdb_file);
     if (openStatus != 0) {
-        do_close(&pictdb_file);
+        close_db(&pictdb_file);
         return openStatus;
     }
 
-    //check if the database isn't full.
-    if(!(pictdb_file.header.num_files < pictdb_file.header.max_files)) {
-        do_close(&pictdb_file);
+    //check if the database isn't full (a format 1 database grows on insertion).
+    if(PICTDB_FORMAT(pictdb_file.header) < PICTDB_FORMAT_CHUNKED
+       && !(pictdb_file.header.num_files < pictdb_file.header.max_files)) {
+        close_db(&pictdb_file);
         return ERR_FULL_DATABASE;
     }
 
     char* image_buffer = NULL;
     size_t * image_size = calloc(1, sizeof(size_t));
     if(image_size == NULL) {
-        do_close(&pictdb_file);
+        close_db(&pictdb_file);
         return ERR_OUT_OF_MEMORY;
     }
     *image_size = 0;
@@ -250,7 +342,7 @@ do_insert_cmd (int args, char *argv[])
         free_the_buffer(&image_buffer);
         free(image_size);
         image_size = NULL;
-        do_close(&pictdb_file);
+        close_db(&pictdb_file);
         return errorRead;
     }
 
@@ -266,7 +358,287 @@ do_insert_cmd (int args, char *argv[])
         free(image_size);
         image_size = NULL;
     }
-    do_close(&pictdb_file);
+    close_db(&pictdb_file);
+    return errorStatus;
+}
+
+/*!\struct insert_batch
+   \brief Lot d'images lues sur le disque, en attente d'insertion.
+*/
+struct insert_batch {
+    struct insert_item items[BATCH_MAX_IMAGES];
+    char pict_ids[BATCH_MAX_IMAGES][MAX_PIC_ID + 1];
+    char* buffers[BATCH_MAX_IMAGES];
+    size_t nb_items;
+    size_t nb_bytes;
+    size_t nb_inserted;
+    size_t nb_failed;
+    unsigned int nb_threads; // threads calculant SHA et résolution (0 : aucun)
+};
+
+/********************************************************************//**
+ * Inserts the pending images of the batch in the database, reports the
+ * rejected ones and frees the image buffers.
+ */
+static int
+flush_batch(struct insert_batch* batch, struct pictdb_file* pictdb_file)
+{
+    int errorStatus = do_insert_batch_parallel(batch->items, batch->nb_items, pictdb_file, batch->nb_threads);
+
+    for (size_t k = 0; k < batch->nb_items; ++k) {
+        if (!errorStatus && batch->items[k].status == 0) {
+            ++batch->nb_inserted;
+        } else {
+            ++batch->nb_failed;
+            if (!errorStatus) {
+                fprintf(stderr, "%s: %s\n", batch->pict_ids[k], ERROR_MESSAGES[batch->items[k].status]);
+            }
+        }
+        free_the_buffer(&batch->buffers[k]);
+    }
+    batch->nb_items = 0;
+    batch->nb_bytes = 0;
+    return errorStatus;
+}
+
+/********************************************************************//**
+ * Reads an image from the disk and adds it to the batch (flushing the
+ * batch first if it is full).
+ */
+static int
+add_to_batch(struct insert_batch* batch, struct pictdb_file* pictdb_file,
+             const char* pict_id, size_t pict_id_len, const char* filename)
+{
+    if (pict_id_len == 0 || pict_id_len > MAX_PIC_ID) {
+        fprintf(stderr, "%s: %s\n", filename, ERROR_MESSAGES[ERR_INVALID_PICID]);
+        ++batch->nb_failed;
+        return 0;
+    }
+
+    char* image_buffer = NULL;
+    size_t image_size = 0;
+    int errorRead = read_disk_image(filename, &image_size, &image_buffer);
+    if (errorRead) {
+        free_the_buffer(&image_buffer);
+        fprintf(stderr, "%s: %s\n", filename, ERROR_MESSAGES[errorRead]);
+        ++batch->nb_failed;
+        return 0;
+    }
+
+    if (batch->nb_items == BATCH_MAX_IMAGES
+        || (batch->nb_items > 0 && batch->nb_bytes + image_size > BATCH_MAX_BYTES)) {
+        int flushStatus = flush_batch(batch, pictdb_file);
+        if (flushStatus) {
+            free_the_buffer(&image_buffer);
+            return flushStatus;
+        }
+    }
+
+    size_t k = batch->nb_items;
+    memcpy(batch->pict_ids[k], pict_id, pict_id_len);
+    batch->pict_ids[k][pict_id_len] = '\0';
+    batch->buffers[k] = image_buffer;
+    batch->items[k].image = image_buffer;
+    batch->items[k].image_size = image_size;
+    batch->items[k].pict_id = batch->pict_ids[k];
+    ++batch->nb_items;
+    batch->nb_bytes += image_size;
+    return 0;
+}
+
+/********************************************************************//**
+ * Adds to the batch every regular file of a directory, the pictID being
+ * the file name without its extension.
+ */
+static int
+batch_from_directory(struct insert_batch* batch, struct pictdb_file* pictdb_file, const char* dirname)
+{
+    DIR* dir = opendir(dirname);
+    if (dir == NULL) {
+        return ERR_IO;
+    }
+
+    int errorStatus = 0;
+    struct dirent* entry = NULL;
+    while (!errorStatus && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        size_t path_len = strlen(dirname) + 1 + strlen(entry->d_name) + 1;
+        char* path = malloc(path_len);
+        if (path == NULL) {
+            errorStatus = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        snprintf(path, path_len, "%s/%s", dirname, entry->d_name);
+
+        struct stat file_stat;
+        if (stat(path, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+            const char* extension = strrchr(entry->d_name, '.');
+            size_t id_len = extension != NULL ? (size_t) (extension - entry->d_name) : strlen(entry->d_name);
+            errorStatus = add_to_batch(batch, pictdb_file, entry->d_name, id_len, path);
+        }
+        free(path);
+    }
+    closedir(dir);
+    return errorStatus;
+}
+
+/********************************************************************//**
+ * Adds to the batch the images listed in a manifest, one
+ * "<pictID> <filename>" per line (empty lines and lines starting with '#'
+ * are ignored).
+ */
+static int
+batch_from_manifest(struct insert_batch* batch, struct pictdb_file* pictdb_file, const char* manifest)
+{
+    FILE* file = fopen(manifest, "r");
+    if (file == NULL) {
+        return ERR_IO;
+    }
+
+    int errorStatus = 0;
+    char line[MANIFEST_LINE_MAX];
+    while (!errorStatus && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char* pict_id = line + strspn(line, " \t");
+        if (*pict_id == '\0' || *pict_id == '#') {
+            continue;
+        }
+        size_t id_len = strcspn(pict_id, " \t");
+        char* filename = pict_id + id_len;
+        filename += strspn(filename, " \t");
+        if (*filename == '\0') {
+            fprintf(stderr, "%s: %s\n", pict_id, ERROR_MESSAGES[ERR_NOT_ENOUGH_ARGUMENTS]);
+            ++batch->nb_failed;
+            continue;
+        }
+        errorStatus = add_to_batch(batch, pictdb_file, pict_id, id_len, filename);
+    }
+    if (!errorStatus && ferror(file)) {
+        errorStatus = ERR_IO;
+    }
+    fclose(file);
+    return errorStatus;
+}
+
+/********************************************************************//**
+ * Inserts many pictures into the database, by batches.
+ */
+int
+do_insert_batch_cmd (int args, char *argv[])
+{
+    if(args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    //optional number of probing threads
+    unsigned int nb_threads = 0;
+    if (args > 3) {
+        if (strcmp(argv[3], THREADS_ARGUMENT) != 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (args < 5) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        nb_threads = atouint32(argv[4]);
+        if (nb_threads < 1 || nb_threads > MAX_PROBE_THREADS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct stat source_stat;
+    if (stat(argv[2], &source_stat) != 0) {
+        return ERR_IO;
+    }
+
+    struct insert_batch* batch = calloc(1, sizeof(struct insert_batch));
+    if (batch == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    batch->nb_threads = nb_threads;
+
+    struct pictdb_file pictdb_file;
+    int openStatus = open_db(argv[1], "r+b", &pictdb_file);
+    if (openStatus != 0) {
+        close_db(&pictdb_file);
+        free(batch);
+        return openStatus;
+    }
+
+    int errorStatus = 0;
+    if (S_ISDIR(source_stat.st_mode)) {
+        errorStatus = batch_from_directory(batch, &pictdb_file, argv[2]);
+    } else {
+        errorStatus = batch_from_manifest(batch, &pictdb_file, argv[2]);
+    }
+    //dernier lot (éventuellement partiel)
+    if (!errorStatus) {
+        errorStatus = flush_batch(batch, &pictdb_file);
+    } else {
+        for (size_t k = 0; k < batch->nb_items; ++k) {
+            free_the_buffer(&batch->buffers[k]);
+        }
+    }
+
+    printf("%zu image(s) inserted, %zu rejected\n", batch->nb_inserted, batch->nb_failed);
+    close_db(&pictdb_file);
+    free(batch);
+    return errorStatus;
+}
+
+/********************************************************************//**
+ * Tells whether the journal of a database is not empty, i.e. whether an
+ * update may have been interrupted: the database must then be opened by
+ * open_db, which replays it, and not read as it is on the disk.
+ */
+static int
+journal_pending(const char* db_name)
+{
+    const size_t length = strlen(db_name) + strlen(JOURNAL_EXTENSION) + 1;
+    char* journal_name = malloc(length);
+    if (journal_name == NULL) {
+        //dans le doute, la base est ouverte par open_db
+        return 1;
+    }
+    snprintf(journal_name, length, "%s%s", db_name, JOURNAL_EXTENSION);
+    struct stat journal_stat;
+    int pending = stat(journal_name, &journal_stat) == 0 && journal_stat.st_size > 0;
+    free(journal_name);
+    return pending;
+}
+
+/********************************************************************//**
+ * Reads an existing picture from a database opened with do_open_paged and
+ * writes it to the disk. Returns ERR_FILE_NOT_FOUND if the picture (or its
+ * resolution) does not exist.
+ */
+static int
+read_paged(const char* db_name, const char* pict_id, int resolution_code)
+{
+    struct pictdb_file pictdb_file;
+    int openStatus = do_open_paged(db_name, &pictdb_file);
+    if (openStatus != 0) {
+        return openStatus;
+    }
+
+    const char* image = NULL;
+    uint32_t image_size = 0;
+    int errorStatus = do_read_view(pict_id, resolution_code, &image, &image_size, &pictdb_file);
+    if (errorStatus == 0) {
+        char* filename = createname(pict_id, resolution_code);
+        if (filename == NULL) {
+            errorStatus = ERR_INVALID_ARGUMENT;
+        } else {
+            //the view points into the mapping: it is not freed
+            char* image_view = (char*) image;
+            errorStatus = write_disk_image(filename, &image_view, image_size);
+            free(filename);
+        }
+    }
+
+    do_close_mmap(&pictdb_file);
     return errorStatus;
 }
 
@@ -285,31 +657,41 @@ do_read_cmd (int args, char *argv[])
         return ERR_INVALID_PICID;
     }
 
-    struct pictdb_file pictdb_file;
-    int openStatus = do_open(argv[1], "r+b", &pictdb_file); //then everytime there is an error, we must not forget to do_close
-    if (openStatus != 0) {
-        do_close(&pictdb_file);
-        return openStatus;
-    }
-
     //we get the resolution code corresponding to the third argument given.
     int resolution_code = resolution_atoi(argv[3]);
     if(resolution_code == -1) {
-        do_close(&pictdb_file);
         return ERR_INVALID_ARGUMENT;
     }
 
+    /*fast path: the image is read from the mapping, only the metadata it needs are loaded
+    (unless an interrupted update must first be replayed from the journal)*/
+    int errorStatus = ERR_FILE_NOT_FOUND;
+    if (!journal_pending(argv[1])) {
+        errorStatus = read_paged(argv[1], argv[2], resolution_code);
+    }
+    if (errorStatus != ERR_FILE_NOT_FOUND) {
+        return errorStatus;
+    }
+
+    //the resolution may not exist yet: do_read creates it
+    struct pictdb_file pictdb_file;
+    int openStatus = open_db(argv[1], "r+b", &pictdb_file); //then everytime there is an error, we must not forget to close_db
+    if (openStatus != 0) {
+        close_db(&pictdb_file);
+        return openStatus;
+    }
+
     //these two pointers are where the image and its length will be stocked in the memory
     char * image_buffer = NULL;
     uint32_t image_size = 0;
     unsigned int errorRead = do_read(argv[2], resolution_code, &image_buffer, &image_size, &pictdb_file);
     if(errorRead) {
         free_the_buffer(&image_buffer);
-        do_close(&pictdb_file);
+        close_db(&pictdb_file);
         return errorRead;
     }
 
-    do_close(&pictdb_file);
+    close_db(&pictdb_file);
 
     //now that we have read and stocked in the RAM the image we're interested in, we can write it on a .jpeg
     char* filename = createname(argv[2], resolution_code);
@@ -317,7 +699,7 @@ do_read_cmd (int args, char *argv[])
         free_the_buffer(&image_buffer);
         return ERR_INVALID_ARGUMENT;
     }
-    int errorStatus = write_disk_image(filename, &image_buffer, image_size);
+    errorStatus = write_disk_image(filename, &image_buffer, image_size);
 
     //we need to free here the image_buffer, since it was allocated in do_read.
     free_the_buffer(&image_buffer);
@@ -341,19 +723,66 @@ do_gc_cmd (int args, char *argv[])
     }
 
     struct pictdb_file pictdb_file;
-    int openStatus = do_open(argv[1], "r+b", &pictdb_file);
+    int openStatus = open_db(argv[1], "r+b", &pictdb_file);
     if (openStatus != 0) {
-        do_close(&pictdb_file);
+        close_db(&pictdb_file);
         return openStatus;
     }
 
     int errorStatus = do_gbcollect(&pictdb_file, argv[1], argv[2]);
-    do_close(&pictdb_file);
+    close_db(&pictdb_file);
     return errorStatus;
 }
 
 
 
+/********************************************************************//**
+ * Reclaims in place the space of deleted pictures (incremental compaction).
+ */
+int
+do_compact_cmd (int args, char *argv[])
+{
+    if(args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    uint32_t step_bytes = STEP_DEFAULT;
+    if (args > 2) {
+        if (strcmp(argv[2], STEP_ARGUMENT) != 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (args < 4) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        step_bytes = atouint32(argv[3]);
+        if (step_bytes == 0) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct pictdb_file pictdb_file;
+    int openStatus = open_db(argv[1], "r+b", &pictdb_file);
+    if (openStatus != 0) {
+        close_db(&pictdb_file);
+        return openStatus;
+    }
+
+    int errorStatus = 0;
+    int finished = 0;
+    uint64_t total_moved = 0;
+    unsigned int nb_steps = 0;
+    while (!errorStatus && !finished) {
+        uint64_t moved = 0;
+        errorStatus = do_compact_step(&pictdb_file, step_bytes, &moved, &finished);
+        total_moved += moved;
+        ++nb_steps;
+    }
+
+    printf("%" PRIu64 " byte(s) moved in %u step(s)\n", total_moved, nb_steps);
+    close_db(&pictdb_file);
+    return errorStatus;
+}
+
 /*!\struct command_mapping
    \brief Struct représentant l'association commande-nom de fonction.
 
@@ -370,11 +799,14 @@ et les nom de fontions utilisées en interne.*/
 const struct command_mapping commands[MAX_COMMANDS] = {
     {"help", help},
     {"list", do_list_cmd},
+    {"stats", do_stats_cmd},
     {"create", do_create_cmd},
     {"delete", do_delete_cmd},
     {"insert", do_insert_cmd},
+    {"insert-batch", do_insert_batch_cmd},
     {"read", do_read_cmd},
-    {"gc", do_gc_cmd}
+    {"gc", do_gc_cmd},
+    {"compact", do_compact_cmd}
 };
 
 /********************************************************************//**
@@ -8,15 +8,41 @@
  * @author Matteo Giorla
  * @date Mai 2016
  */
+#define _GNU_SOURCE // for pthread_rwlock_t and sendfile with -std=c99
 #include <stdlib.h>
 #include <stdint.h> // for uint32_t
+#include <ctype.h> // for isdigit
+#include <inttypes.h> // for PRIu32 and PRIu64
+#include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h> // for clock_gettime
+#include <sched.h> // for sched_yield
+#ifdef __linux__
+#include <errno.h>
+#include <sys/sendfile.h> // for sendfile
+#endif
 #include <vips/vips.h>
 #include "libmongoose/mongoose.h"
 #include "pictDB.h"
+#include "db_index.h" // for index_find_id
+#include "derive_queue.h" // for derive_queue_start
+#include "db_journal.h" // for journal_open
+#include "image_cache.h" // for the cache of the reduced images
 
 #define MAX_QUERY_PARAM 5
+#define MAX_HEADER_LEN 512
+#define MAX_RANGE_LEN 64
+#define TRANSFER_CHUNK (64 * 1024) // bytes of an image read from the file at once while it is sent
+#define WORKERS_ARGUMENT "-workers"
+#define DERIVERS_ARGUMENT "-derivers"
+#define COMPACT_ARGUMENT "-compact"
+#define CACHE_ARGUMENT "-cache"
+#define CACHE_DEFAULT (16 * 1024 * 1024)
+#define MAX_WORKERS 64
 #define RES_ARG "res"
+#define ETAG_SIZE (2 * SHA256_DIGEST_LENGTH + 8) // "<SHA in hex>-<resolution>" and the final '\0'
+#define CACHE_CONTROL "public, max-age=60" // a picture can be deleted and its pict_id reused
 #define PIC_ARG "pict_id"
 
 static const char *s_http_port = "8000";
@@ -25,6 +51,117 @@ static struct mg_serve_http_opts s_http_server_opts;
 //the struct on wihch we work internally with all pictDB commands.
 static struct pictdb_file webStruct;
 
+/* Reader-writer lock on webStruct: lookups, reads of existing resolutions and
+ * the pins of the images being sent take it shared, everything that writes
+ * into the database takes it exclusive. */
+static pthread_rwlock_t db_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+//the event manager, global so that the workers can wake it up with mg_broadcast.
+static struct mg_mgr mgr;
+
+/*! \enum request_kind
+  The pictDB calls the server handles itself.
+ */
+enum request_kind {
+    LIST_CALL, READ_CALL, INSERT_CALL, DELETE_CALL, STATS_CALL
+};
+
+/*! \struct request
+    \brief The parts of an HTTP request needed by the handlers.
+
+ In worker mode they are copied, since the http_message does not outlive
+ the event handler.
+*/
+struct request {
+    enum request_kind kind;
+    const char* query;
+    size_t query_len;
+    const char* body;
+    size_t body_len;
+    const char* if_none_match; // value of the If-None-Match header (NULL if absent)
+    size_t if_none_match_len;
+    const char* range; // value of the Range header (NULL if absent)
+    size_t range_len;
+    const char* if_range; // value of the If-Range header (NULL if absent)
+    size_t if_range_len;
+};
+
+/*! \struct response
+    \brief A response prepared by a handler, sent by the I/O thread.
+
+ Either data holds the whole response, or has_image is set and the image
+ at offset, pinned by locate_image, is streamed from the database file.
+*/
+struct response {
+    struct mbuf data;
+    int has_image;
+    char pict_id[MAX_PIC_ID + 1];
+    int resolution_code;
+    uint64_t offset;
+    uint32_t image_size;
+    char etag[ETAG_SIZE]; // validator of the image, sent with it
+    int partial; // only range_length bytes of the image, from range_start, are sent (206)
+    uint32_t range_start;
+    uint32_t range_length;
+};
+
+/*! \struct transfer
+    \brief An image being sent on a connection.
+
+ On Linux the image is sent with non-blocking sendfile calls, straight
+ from the page cache to the socket. Otherwise, or when the socket is
+ full, it is read from the file one chunk at a time and queued in
+ mongoose, only when mongoose has sent the previous one, so that a slow
+ client never blocks the event loop. It stays pinned until the transfer
+ ends: the database is not locked while it is read.
+*/
+struct transfer {
+    uint64_t offset; // of the whole image, as located by the read call
+    uint64_t position; // in the file, of the next byte to send
+    uint64_t remaining;
+    int copy_only; // sendfile can not be used: every chunk goes through mongoose
+};
+
+/*! \struct connection_state
+    \brief What the server keeps on a connection (its user_data).
+*/
+struct connection_state {
+    unsigned long conn_id; // job whose response is awaited (0: none)
+    struct transfer* transfer; // image being sent (NULL: none)
+};
+
+/*! \struct job
+    \brief A request handed to the worker threads, and its response.
+*/
+struct job {
+    unsigned long conn_id; // stored in the connection_state of the connection
+    struct request request;
+    struct response response;
+    struct job* next;
+};
+
+//worker pool (nb_workers == 0 means that the requests are handled by the I/O thread).
+static unsigned int nb_workers = 0;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct job* pending_jobs = NULL;
+static struct job* pending_jobs_tail = NULL;
+static struct job* done_jobs = NULL;
+static unsigned long next_conn_id = 1;
+
+//number of background threads generating the reduced images of inserted pictures (0: none).
+static unsigned int nb_derivers = 0;
+
+//maximum number of bytes moved by each online compaction step (0: no compaction).
+static unsigned int compact_step_bytes = 0;
+static pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int compact_wanted = 0; // the database changed since the compaction thread last slept
+
+//budget of bytes of the cache of thumbnails and small images (0: no cache).
+static unsigned int cache_bytes = CACHE_DEFAULT;
+static struct image_cache image_cache;
+
 //the title says everything
 //FOR THIS ALGORITM TO WORK, file_name SHOULD OBLIGATORY END WITH A \0 !!!
 //Actually doesn't remove only ".jpg", remove everything that comes after a point (".")
@@ -87,13 +224,36 @@ void split (char* result[], char* tmp, const char* src, const char* delim, size_
     }
 }
 
+/********************************************************************//**
+ * Appends formatted text to the response.
+ */
+static void response_printf(struct response* resp, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len <= 0) {
+        return;
+    }
+
+    char* text = calloc(len + 1, sizeof(char));
+    if (text != NULL) {
+        va_start(ap, fmt);
+        vsnprintf(text, len + 1, fmt, ap);
+        va_end(ap);
+        mbuf_append(&resp->data, text, len);
+        free(text);
+    }
+}
+
 /********************************************************************//**
  * Simply sends the webpage the error the server encountered.
  */
-void mg_error(struct mg_connection* nc, int error)
+static void response_error(struct response* resp, int error)
 {
-    mg_printf(nc,   "HTTP/1.1 500 "
-              "%s", ERROR_MESSAGES[error]);
+    response_printf(resp, "HTTP/1.1 500 "
+                    "%s", ERROR_MESSAGES[error]);
 }
 
 /*utilitary function which takes care of freeing len
@@ -113,33 +273,516 @@ static void free_result(char ** result, const size_t len)
 /********************************************************************//**
  * Implementation of list call from the webPage
  */
-static void handle_list_call(struct mg_connection *nc)
+static void handle_list_call(struct response* resp)
 {
-
+    pthread_rwlock_rdlock(&db_lock);
     const char* json_list = do_list(&webStruct, JSON);
+    pthread_rwlock_unlock(&db_lock);
+
     if(json_list == NULL) {
-        mg_printf(nc, "HTTP/1.1 500 Internal Servor Error\r\n");
+        response_printf(resp, "HTTP/1.1 500 Internal Servor Error\r\n");
     } else {
         //respond to the connection the list of pict in JSON (string) format.
-        mg_printf(nc,"HTTP/1.1 200 OK\r\n"
-                  "Content-Type: application/json\r\n"
-                  "Content-Length: %zu\r\n\r\n"
-                  "%s", strlen(json_list), json_list);
+        response_printf(resp, "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: application/json\r\n"
+                        "Content-Length: %zu\r\n\r\n"
+                        "%s", strlen(json_list), json_list);
+    }
+}
+
+/********************************************************************//**
+ * Unpins an image pinned by locate_image.
+ */
+static void unpin_image(uint64_t offset)
+{
+    pthread_rwlock_rdlock(&db_lock);
+    index_unpin_blob(&webStruct, offset);
+    pthread_rwlock_unlock(&db_lock);
+}
+
+/********************************************************************//**
+ * Locates an image in the database, creating its resolution if needed,
+ * and pins it: its place is kept until unpin_image, so that it is read
+ * and sent without holding the lock. The (slow) decoding and resizing is
+ * done without holding the lock too, so it never blocks the other calls.
+ * SHA is the one of the picture the image belongs to, and db_version the
+ * version of the database it was located in.
+ */
+static int locate_image(const char* pict_id, int resolution_code, uint64_t* offset, uint32_t* image_size,
+                        unsigned char SHA[SHA256_DIGEST_LENGTH], uint32_t* db_version)
+{
+    //the count of pins is atomic: the lookup and the pin only need the lock shared
+    pthread_rwlock_rdlock(&db_lock);
+    int slot = index_find_id(&webStruct, pict_id);
+    if (slot < 0) {
+        pthread_rwlock_unlock(&db_lock);
+        return ERR_FILE_NOT_FOUND;
+    }
+    struct pict_metadata metadata = webStruct.metadata[slot];
+    if (metadata.offset[resolution_code] != 0 && metadata.size[resolution_code] != 0) {
+        //the resolution already exists
+        int status = index_pin_blob(&webStruct, metadata.offset[resolution_code]);
+        *offset = metadata.offset[resolution_code];
+        *image_size = metadata.size[resolution_code];
+        memcpy(SHA, metadata.SHA, SHA256_DIGEST_LENGTH);
+        *db_version = webStruct.header.db_version;
+        pthread_rwlock_unlock(&db_lock);
+        return status;
+    }
+    if (metadata.offset[RES_ORIG] == 0 || metadata.size[RES_ORIG] == 0) {
+        pthread_rwlock_unlock(&db_lock);
+        return ERR_FILE_NOT_FOUND;
+    }
+    //the original is pinned while it is read
+    int status = index_pin_blob(&webStruct, metadata.offset[RES_ORIG]);
+    pthread_rwlock_unlock(&db_lock);
+    if (status) {
+        return status;
+    }
+    char* original = NULL;
+    status = read_image_at(&webStruct, metadata.offset[RES_ORIG], metadata.size[RES_ORIG], &original);
+    if (status) {
+        unpin_image(metadata.offset[RES_ORIG]);
+        return status;
+    }
+
+    //the other reduced image, if it is missing too, is made from the same decoding of the original
+    int needed[RES_ORIG];
+    needed[RES_THUMB] = metadata.size[RES_THUMB] == 0;
+    needed[RES_SMALL] = metadata.size[RES_SMALL] == 0;
+    char* resized[RES_ORIG];
+    size_t resized_size[RES_ORIG];
+    status = create_reduced_images(original, metadata.size[RES_ORIG], &webStruct.header, needed, resized, resized_size);
+    free_the_buffer(&original);
+    if (status) {
+        unpin_image(metadata.offset[RES_ORIG]);
+        return status;
+    }
+
+    pthread_rwlock_wrlock(&db_lock);
+    index_unpin_blob(&webStruct, metadata.offset[RES_ORIG]);
+    /*the picture may have been deleted (and its id reused), or resized by another thread, in the meantime:
+    the reduced images are only stored if the picture still has the original they were made from*/
+    slot = index_find_id(&webStruct, pict_id);
+    if (slot < 0) {
+        status = ERR_FILE_NOT_FOUND;
+    } else {
+        if (webStruct.metadata[slot].offset[RES_ORIG] == metadata.offset[RES_ORIG]
+            && memcmp(webStruct.metadata[slot].SHA, metadata.SHA, SHA256_DIGEST_LENGTH) == 0) {
+            for (int res = RES_THUMB; res < RES_ORIG; ++res) {
+                if (webStruct.metadata[slot].size[res] != 0) {
+                    free_the_buffer(&resized[res]);
+                }
+            }
+            if (resized[RES_THUMB] != NULL || resized[RES_SMALL] != NULL) {
+                status = store_reduced_images(&webStruct, slot, resized, resized_size);
+                fflush(webStruct.fpdb);
+            }
+        }
+        if (status == 0 && webStruct.metadata[slot].size[resolution_code] == 0) {
+            //another picture now has this id, and not this resolution yet
+            status = ERR_FILE_NOT_FOUND;
+        }
+        if (status == 0) {
+            *offset = webStruct.metadata[slot].offset[resolution_code];
+            *image_size = webStruct.metadata[slot].size[resolution_code];
+            memcpy(SHA, webStruct.metadata[slot].SHA, SHA256_DIGEST_LENGTH);
+            *db_version = webStruct.header.db_version;
+            status = index_pin_blob(&webStruct, *offset);
+        }
+    }
+    pthread_rwlock_unlock(&db_lock);
+    free_the_buffer(&resized[RES_THUMB]);
+    free_the_buffer(&resized[RES_SMALL]);
+    return status;
+}
+
+/********************************************************************//**
+ * Formats the HTTP headers sent with an image. Returns their length,
+ * -1 if they do not fit in the buffer.
+ */
+static int image_headers(char* header, size_t header_size, const struct response* resp, uint32_t image_size)
+{
+    int header_len = 0;
+    if (resp->partial) {
+        header_len = snprintf(header, header_size, "HTTP/1.1 206 Partial Content\r\n"
+                              "Content-Type: image/jpeg \r\n"
+                              "Content-Length: %" PRIu32 "\r\n"
+                              "Content-Range: bytes %" PRIu32 "-%" PRIu32 "/%" PRIu32 "\r\n",
+                              resp->range_length, resp->range_start,
+                              resp->range_start + resp->range_length - 1, image_size);
+    } else {
+        header_len = snprintf(header, header_size, "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: image/jpeg \r\n"
+                              "Content-Length: %" PRIu32 "\r\n", image_size);
+    }
+    if (header_len < 0 || (size_t) header_len >= header_size) {
+        return -1;
+    }
+    //only the originals can be fetched by ranges
+    int end_len = snprintf(header + header_len, header_size - header_len, "%s"
+                           "ETag: %s\r\n"
+                           "Cache-Control: " CACHE_CONTROL "\r\n\r\n",
+                           resp->resolution_code == RES_ORIG ? "Accept-Ranges: bytes\r\n" : "", resp->etag);
+    if (end_len < 0 || (size_t) end_len >= header_size - header_len) {
+        return -1;
+    }
+    return header_len + end_len;
+}
+
+/********************************************************************//**
+ * Puts in the response the whole answer to a read call, with an image
+ * held in memory.
+ */
+static void response_image(struct response* resp, const char* image, uint32_t image_size)
+{
+    char header[MAX_HEADER_LEN];
+    int header_len = image_headers(header, sizeof(header), resp, image_size);
+    if (header_len < 0) {
+        response_error(resp, ERR_IO);
+        return;
+    }
+    mbuf_append(&resp->data, header, header_len);
+    mbuf_append(&resp->data, image, image_size);
+}
+
+/********************************************************************//**
+ * Looks up the SHA of a picture and the current version of the database.
+ */
+static int lookup_picture(const char* pict_id, unsigned char SHA[SHA256_DIGEST_LENGTH], uint32_t* db_version)
+{
+    pthread_rwlock_rdlock(&db_lock);
+    int slot = index_find_id(&webStruct, pict_id);
+    if (slot >= 0) {
+        memcpy(SHA, webStruct.metadata[slot].SHA, SHA256_DIGEST_LENGTH);
+    }
+    *db_version = webStruct.header.db_version;
+    pthread_rwlock_unlock(&db_lock);
+    return slot < 0 ? ERR_FILE_NOT_FOUND : 0;
+}
+
+/********************************************************************//**
+ * Makes the (strong) ETag of an image: the SHA of the picture and the
+ * resolution, since the content of a resolution of a picture never changes.
+ */
+static const char* make_etag(char etag[ETAG_SIZE], const unsigned char SHA[SHA256_DIGEST_LENGTH], int resolution_code)
+{
+    char* cursor = etag;
+    *cursor++ = '"';
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        cursor += sprintf(cursor, "%02x", SHA[i]);
+    }
+    snprintf(cursor, ETAG_SIZE - (cursor - etag), "-%d\"", resolution_code);
+    return etag;
+}
+
+/********************************************************************//**
+ * Moves start and end inwards past the spaces and tabs around a value.
+ */
+static void trim_spaces(const char** start, const char** end)
+{
+    while (*start < *end && (**start == ' ' || **start == '\t')) {
+        ++*start;
+    }
+    while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t')) {
+        --*end;
+    }
+}
+
+/********************************************************************//**
+ * Tells whether the If-None-Match header of a request matches the ETag:
+ * its whole value is "*", or one of its comma-separated elements is the
+ * ETag (weak comparison: a "W/" prefix is ignored).
+ */
+static int etag_matches(const struct request* req, const char* etag)
+{
+    if (req->if_none_match == NULL) {
+        return 0;
+    }
+    const size_t etag_len = strlen(etag);
+    const char* value = req->if_none_match;
+    const char* value_end = value + req->if_none_match_len;
+    trim_spaces(&value, &value_end);
+    if (value_end - value == 1 && *value == '*') {
+        return 1;
+    }
+
+    while (value < value_end) {
+        const char* element = value;
+        const char* element_end = memchr(element, ',', value_end - element);
+        if (element_end == NULL) {
+            element_end = value_end;
+        }
+        value = element_end + 1;
+        trim_spaces(&element, &element_end);
+        if (element_end - element >= 2 && strncmp(element, "W/", 2) == 0) {
+            element += 2;
+        }
+        if ((size_t) (element_end - element) == etag_len && strncmp(element, etag, etag_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Parses the Range header of a request (a single range of bytes) for an
+ * image of image_size bytes. Returns 1 and the range if it is satisfiable,
+ * 0 if the header has to be ignored (absent, several ranges, invalid, or
+ * If-Range does not match the ETag) and -1 if it can not be satisfied.
+ */
+static int parse_range(const struct request* req, const char* etag, uint32_t image_size,
+                       uint32_t* start, uint32_t* length)
+{
+    if (req->range == NULL || req->range_len >= MAX_RANGE_LEN) {
+        return 0;
+    }
+    if (req->if_range != NULL && (req->if_range_len != strlen(etag)
+                                  || strncmp(req->if_range, etag, req->if_range_len) != 0)) {
+        //the client has another version of the image: it gets the whole new one
+        return 0;
+    }
+    char range[MAX_RANGE_LEN];
+    memcpy(range, req->range, req->range_len);
+    range[req->range_len] = '\0';
+    if (strncmp(range, "bytes=", strlen("bytes=")) != 0 || strchr(range, ',') != NULL) {
+        return 0;
+    }
+
+    //strtoull would also accept spaces and signs: each bound has to start with a digit
+    const char* first = range + strlen("bytes=");
+    char* end = NULL;
+    if (*first == '-') {
+        //suffix: the last bytes of the image
+        if (!isdigit((unsigned char) first[1])) {
+            return 0;
+        }
+        unsigned long long suffix = strtoull(first + 1, &end, 10);
+        if (*end != '\0') {
+            return 0;
+        }
+        if (suffix == 0 || image_size == 0) {
+            return -1;
+        }
+        *length = suffix < image_size ? (uint32_t) suffix : image_size;
+        *start = image_size - *length;
+        return 1;
+    }
+
+    if (!isdigit((unsigned char) *first)) {
+        return 0;
+    }
+    unsigned long long first_byte = strtoull(first, &end, 10);
+    if (*end != '-') {
+        return 0;
+    }
+    const char* last = end + 1;
+    unsigned long long last_byte = image_size > 0 ? image_size - 1ULL : 0;
+    if (*last != '\0') {
+        if (!isdigit((unsigned char) *last)) {
+            return 0;
+        }
+        last_byte = strtoull(last, &end, 10);
+        if (*end != '\0' || last_byte < first_byte) {
+            return 0;
+        }
+    }
+    if (first_byte >= image_size) {
+        return -1;
+    }
+    if (last_byte >= image_size) {
+        last_byte = image_size - 1ULL;
+    }
+    *start = (uint32_t) first_byte;
+    *length = (uint32_t) (last_byte - first_byte + 1);
+    return 1;
+}
+
+/********************************************************************//**
+ * Answers a read call with the cached copy of the image, if there is one.
+ * Returns 1 if it did, 0 otherwise.
+ */
+static int read_from_cache(struct response* resp, const char* pict_id, int resolution_code, uint32_t db_version)
+{
+    char* image = NULL;
+    uint32_t image_size = 0;
+    if (image_cache_get(&image_cache, pict_id, resolution_code, db_version, &image, &image_size) != 0) {
+        return 0;
+    }
+    response_image(resp, image, image_size);
+    free_the_buffer(&image);
+    return 1;
+}
+
+/********************************************************************//**
+ * Reads the image located (and pinned) by a read call in the database at
+ * version db_version, adds it to the cache and answers with it. If it can
+ * not be read, the response is left as it is (the image is then streamed
+ * from the file).
+ */
+static void read_into_cache(struct response* resp, uint32_t db_version)
+{
+    char* image = NULL;
+    if (read_image_at(&webStruct, resp->offset, resp->image_size, &image) != 0) {
+        return;
+    }
+
+    image_cache_put(&image_cache, resp->pict_id, resp->resolution_code, db_version, image, resp->image_size);
+    resp->has_image = 0;
+    unpin_image(resp->offset);
+    response_image(resp, image, resp->image_size);
+    free_the_buffer(&image);
+}
+
+/********************************************************************//**
+ * Returns the state of a connection, created on first use (NULL if out of memory).
+ */
+static struct connection_state* connection_state(struct mg_connection *nc)
+{
+    if (nc->user_data == NULL) {
+        nc->user_data = calloc(1, sizeof(struct connection_state));
+    }
+    return nc->user_data;
+}
+
+/********************************************************************//**
+ * Ends the transfer of a connection, if any, and unpins its image.
+ */
+static void end_transfer(struct connection_state* state)
+{
+    if (state->transfer != NULL) {
+        unpin_image(state->transfer->offset);
+        free(state->transfer);
+        state->transfer = NULL;
+    }
+}
+
+/********************************************************************//**
+ * Frees the state of a closed connection (the transfer may be unfinished).
+ */
+static void free_connection_state(struct mg_connection *nc)
+{
+    struct connection_state* state = nc->user_data;
+    if (state != NULL) {
+        end_transfer(state);
+        free(state);
+        nc->user_data = NULL;
     }
-    nc->flags |= MG_F_SEND_AND_CLOSE; //"refresh" la connexion à la page index
+}
+
+/********************************************************************//**
+ * Sends the next part of the image being sent (I/O thread only). Called
+ * when the transfer starts, then on MG_EV_SEND and MG_EV_POLL.
+ *
+ * Once mongoose has sent everything it holds (the headers first), the
+ * image is sent with sendfile until the socket is full. A chunk is then
+ * read and queued in mongoose, which sends it as soon as the socket can
+ * take it and comes back with MG_EV_SEND. Without sendfile, chunks are
+ * queued as long as mongoose holds less than TRANSFER_CHUNK bytes.
+ */
+static void continue_transfer(struct mg_connection *nc)
+{
+    struct connection_state* state = nc->user_data;
+    if (state == NULL || state->transfer == NULL) {
+        return;
+    }
+    struct transfer* transfer = state->transfer;
+#ifdef __linux__
+    if (!transfer->copy_only) {
+        if (nc->send_mbuf.len > 0) {
+            return;
+        }
+        while (transfer->remaining > 0) {
+            //the image is pinned: it is sent without the lock
+            off_t position = (off_t) transfer->position;
+            ssize_t sent = sendfile(nc->sock, fileno(webStruct.fpdb), &position, transfer->remaining);
+            if (sent > 0) {
+                transfer->position += sent;
+                transfer->remaining -= sent;
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else {
+                //EAGAIN: the socket is full; otherwise sendfile can not send this image
+                transfer->copy_only = !(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+                break;
+            }
+        }
+    }
+#endif
+    while (transfer->remaining > 0 && nc->send_mbuf.len < TRANSFER_CHUNK) {
+        const uint32_t chunk_size = transfer->remaining < TRANSFER_CHUNK ? transfer->remaining : TRANSFER_CHUNK;
+        char* chunk = NULL;
+        //the image is pinned: it is read without the lock
+        if (read_image_at(&webStruct, transfer->position, chunk_size, &chunk) != 0) {
+            //the response is partially sent, the connection can only be dropped
+            end_transfer(state);
+            nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+            return;
+        }
+        mg_send(nc, chunk, (int) chunk_size);
+        free_the_buffer(&chunk);
+        transfer->position += chunk_size;
+        transfer->remaining -= chunk_size;
+    }
+    if (transfer->remaining == 0) {
+        end_transfer(state);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+}
+
+/********************************************************************//**
+ * Sends the image located by a read call: the headers are queued, then
+ * the image (or the requested range) is sent by continue_transfer.
+ * The transfer takes over the pin of the image.
+ */
+static void send_image(struct mg_connection *nc, const struct response* resp)
+{
+    char header[MAX_HEADER_LEN];
+    int header_len = image_headers(header, sizeof(header), resp, resp->image_size);
+    struct connection_state* state = connection_state(nc);
+    struct transfer* transfer = calloc(1, sizeof(struct transfer));
+    if (header_len < 0 || state == NULL || transfer == NULL) {
+        free(transfer);
+        unpin_image(resp->offset);
+        mg_printf(nc, "HTTP/1.1 500 "
+                  "%s", ERROR_MESSAGES[header_len < 0 ? ERR_IO : ERR_OUT_OF_MEMORY]);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+    }
+    transfer->offset = resp->offset;
+    //only the requested window of the image is read from the file
+    transfer->position = resp->offset + (resp->partial ? resp->range_start : 0);
+    transfer->remaining = resp->partial ? resp->range_length : resp->image_size;
+    end_transfer(state);
+    state->transfer = transfer;
+    mg_send(nc, header, header_len);
+    continue_transfer(nc);
+}
+
+/********************************************************************//**
+ * Answers a read call whose image the client already has (its ETag is in resp).
+ */
+static void response_not_modified(struct response* resp)
+{
+    response_printf(resp, "HTTP/1.1 304 Not Modified\r\n"
+                    "ETag: %s\r\n"
+                    "Cache-Control: " CACHE_CONTROL "\r\n\r\n", resp->etag);
 }
 
 /********************************************************************//**
  * Implementation of read call from the webPage
  */
-static void handle_read_call(struct mg_connection *nc, struct http_message * const http_m)
+static void handle_read_call(struct response* resp, const struct request* req)
 {
     char** result = calloc(MAX_QUERY_PARAM, sizeof(char*));
     char* tmp = calloc((MAX_PIC_ID + 1) * MAX_QUERY_PARAM, sizeof(char));
     if (result == NULL || tmp == NULL) {
-        mg_error(nc, ERR_OUT_OF_MEMORY);
+        free(result);
+        free(tmp);
+        response_error(resp, ERR_OUT_OF_MEMORY);
+        return;
     }
-    split(result, tmp, http_m->query_string.p, "&=", http_m->query_string.len);
+    split(result, tmp, req->query, "&=", req->query_len);
     const char * pictID = NULL;
     const char * reso = NULL;
     //will get the argument of do read in the result Array
@@ -154,24 +797,53 @@ static void handle_read_call(struct mg_connection *nc, struct http_message * con
     }
     //these two pointers are where the image and its length will be stocked in the memory
     int resolution_code = resolution_atoi(reso);
+    //only the reduced images are cached: the originals are streamed from the file
+    const int cached = cache_bytes > 0 && resolution_code != RES_ORIG;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t db_version = 0;
     if(resolution_code == -1 || reso == NULL || pictID == NULL) {
-        mg_error(nc, ERR_INVALID_ARGUMENT);
+        response_error(resp, ERR_INVALID_ARGUMENT);
+    } else if (lookup_picture(pictID, SHA, &db_version) != 0) {
+        response_error(resp, ERR_FILE_NOT_FOUND);
+    } else if (etag_matches(req, make_etag(resp->etag, SHA, resolution_code))) {
+        //the client already has this image
+        response_not_modified(resp);
+    } else if (cached && read_from_cache(resp, pictID, resolution_code, db_version)) {
+        //answered from the cache, the file was not used
     } else {
-        char * image_buffer = NULL;
+        //the image is only located here (and resized if needed), it is streamed from the file afterwards
+        uint64_t offset = 0;
         uint32_t image_size = 0;
-        unsigned int read_status = do_read(pictID, resolution_code, &image_buffer, &image_size, &webStruct);//free en trop dans do read.
-        if (read_status != 0) {
-            mg_error(nc, read_status);
+        unsigned int locate_status = locate_image(pictID, resolution_code, &offset, &image_size, SHA, &db_version);
+        if (locate_status != 0) {
+            response_error(resp, locate_status);
+        } else if (etag_matches(req, make_etag(resp->etag, SHA, resolution_code))) {
+            //the pict_id was reused since the lookup, and the client already has the new picture
+            unpin_image(offset);
+            response_not_modified(resp);
         } else {
-            mg_printf(nc,"HTTP/1.1 200 OK\r\n"
-                      "Content-Type: image/jpeg \r\n"
-                      "Content-Length: %" PRIu32 "\r\n\r\n", image_size);
-
-            mg_send(nc, image_buffer, (int)image_size); //envoi de l'image
-        };
-        nc->flags |= MG_F_SEND_AND_CLOSE; //"refresh" la connexion à la page index
-        //freeing the buffer here regardless of what the output of do_read is.
-        free_the_buffer(&image_buffer);
+            resp->has_image = 1;
+            strncpy(resp->pict_id, pictID, MAX_PIC_ID);
+            resp->resolution_code = resolution_code;
+            resp->offset = offset;
+            resp->image_size = image_size;
+            int range_status = 0;
+            if (resolution_code == RES_ORIG) {
+                range_status = parse_range(req, resp->etag, image_size, &resp->range_start, &resp->range_length);
+            }
+            if (range_status < 0) {
+                resp->has_image = 0;
+                unpin_image(offset);
+                response_printf(resp, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                "Content-Range: bytes */%" PRIu32 "\r\n"
+                                "Content-Length: 0\r\n\r\n", image_size);
+            } else {
+                resp->partial = range_status;
+            }
+            if (cached && image_size <= cache_bytes / IMAGE_CACHE_MAX_SHARE) {
+                read_into_cache(resp, db_version);
+            }
+        }
     }
     //libération de toute mémoire allouée précedemment.
     free_result(result, MAX_QUERY_PARAM);
@@ -186,10 +858,71 @@ static void handle_read_call(struct mg_connection *nc, struct http_message * con
 }
 
 
+/********************************************************************//**
+ * Wakes the compaction thread up after a change of the database.
+ */
+static void compact_wake(void)
+{
+    if (compact_step_bytes == 0) {
+        return;
+    }
+    pthread_mutex_lock(&compact_mutex);
+    compact_wanted = 1;
+    pthread_cond_signal(&compact_cond);
+    pthread_mutex_unlock(&compact_mutex);
+}
+
+/********************************************************************//**
+ * Compaction thread: runs bounded steps of online compaction, each under
+ * the exclusive lock, as long as the database changed since it was last
+ * found compact. Between the changes, or while the images being sent
+ * block it, it sleeps and looks again at most once per second.
+ */
+static void* compact_main(void* arg)
+{
+    (void) arg;
+    int compact_known = 0;
+    uint32_t compact_version = 0;
+    for (;;) {
+        pthread_rwlock_rdlock(&db_lock);
+        int wanted = !compact_known || webStruct.header.db_version != compact_version;
+        pthread_rwlock_unlock(&db_lock);
+
+        uint64_t moved = 0;
+        if (wanted) {
+            int finished = 0;
+            pthread_rwlock_wrlock(&db_lock);
+            int status = do_compact_step(&webStruct, compact_step_bytes, &moved, &finished);
+            compact_version = webStruct.header.db_version;
+            pthread_rwlock_unlock(&db_lock);
+            if (status) {
+                fprintf(stderr, "Compaction step failed: %s\n", ERROR_MESSAGES[status]);
+            }
+            //on error, the next steps are only tried once the database changes
+            compact_known = finished || status;
+        }
+
+        if (!compact_known && moved > 0) {
+            //lets the requests waiting for the lock in before the next step
+            sched_yield();
+        } else {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_mutex_lock(&compact_mutex);
+            while (!compact_wanted && pthread_cond_timedwait(&compact_cond, &compact_mutex, &deadline) == 0) {
+            }
+            compact_wanted = 0;
+            pthread_mutex_unlock(&compact_mutex);
+        }
+    }
+    return NULL;
+}
+
 /********************************************************************//**
  * Implementation of insert call from the webPage
  */
-static void handle_insert_call(struct mg_connection *nc, struct http_message * const http_m)
+static void handle_insert_call(struct response* resp, const struct request* req)
 {
 
     char var_name[100], file_name[MAX_PIC_ID];
@@ -197,8 +930,8 @@ static void handle_insert_call(struct mg_connection *nc, struct http_message * c
     size_t chunk_len, n1, n2;
 
     n1 = n2 = 0;
-    while ((n2 = mg_parse_multipart(http_m->body.p + n1,
-                                    http_m->body.len - n1,
+    while ((n2 = mg_parse_multipart(req->body + n1,
+                                    req->body_len - n1,
                                     var_name, sizeof(var_name),
                                     file_name, sizeof(file_name),
                                     &chunk, &chunk_len)) > 0) {
@@ -206,28 +939,34 @@ static void handle_insert_call(struct mg_connection *nc, struct http_message * c
     }
 
     char* pict_id = remove_jpg(file_name);
+    pthread_rwlock_wrlock(&db_lock);
     int insert_status = do_insert(chunk, chunk_len, pict_id, &webStruct);
+    fflush(webStruct.fpdb);
+    pthread_rwlock_unlock(&db_lock);
+    compact_wake();
     if (insert_status != 0) {
-        mg_error(nc, insert_status);
+        response_error(resp, insert_status);
     } else {
-        mg_printf(nc,   "HTTP/1.1 302 Found\r\n"
-                  "Location: http://localhost:%s/index.html\r\n", s_http_port);
+        response_printf(resp, "HTTP/1.1 302 Found\r\n"
+                        "Location: http://localhost:%s/index.html\r\n", s_http_port);
     }
-    nc->flags |= MG_F_SEND_AND_CLOSE; //"refresh" la connexion à la page index
 }
 
 /********************************************************************//**
  * Implementation of delete call from the webPage
  */
-static void handle_delete_call(struct mg_connection *nc, struct http_message * const http_m)
+static void handle_delete_call(struct response* resp, const struct request* req)
 {
     char** result = calloc(MAX_QUERY_PARAM, sizeof(char*));
     char* tmp = calloc((MAX_PIC_ID + 1) * MAX_QUERY_PARAM, sizeof(char));
     if (result == NULL || tmp == NULL) {
-        mg_error(nc, ERR_OUT_OF_MEMORY);
+        free(result);
+        free(tmp);
+        response_error(resp, ERR_OUT_OF_MEMORY);
+        return;
     }
 
-    split(result, tmp, http_m->query_string.p, "&=", http_m->query_string.len);
+    split(result, tmp, req->query, "&=", req->query_len);
     const char * pict_id = NULL;
     //this will get the arguments of do read in the result Array
     for(int i = 0; i < MAX_QUERY_PARAM-1; ++i) {
@@ -236,7 +975,11 @@ static void handle_delete_call(struct mg_connection *nc, struct http_message * c
         }
     }
 
+    pthread_rwlock_wrlock(&db_lock);
     int delete_status = do_delete(pict_id, &webStruct);
+    fflush(webStruct.fpdb);
+    pthread_rwlock_unlock(&db_lock);
+    compact_wake();
 
     //free all the memory
     free_result(result, MAX_QUERY_PARAM);
@@ -250,12 +993,219 @@ static void handle_delete_call(struct mg_connection *nc, struct http_message * c
     }
 
     if (delete_status != 0) {
-        mg_error(nc, delete_status);
+        response_error(resp, delete_status);
+    } else {
+        response_printf(resp, "HTTP/1.1 302 Found\r\n"
+                        "Location: http://localhost:%s/index.html\r\n", s_http_port);
+    }
+}
+
+/********************************************************************//**
+ * Implementation of stats call: the counters of the image cache, in JSON.
+ */
+static void handle_stats_call(struct response* resp)
+{
+    struct image_cache_stats stats;
+    image_cache_get_stats(&image_cache, &stats);
+
+    char json[MAX_HEADER_LEN];
+    int json_len = snprintf(json, sizeof(json), "{\"cache\": {\"max_bytes\": %" PRIu64 ", \"bytes\": %" PRIu64
+                            ", \"entries\": %" PRIu32 ", \"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+                            ", \"evictions\": %" PRIu64 ", \"invalidations\": %" PRIu64 "}}",
+                            stats.max_bytes, stats.nb_bytes, stats.nb_entries, stats.hits, stats.misses,
+                            stats.evictions, stats.invalidations);
+    if (json_len < 0 || (size_t) json_len >= sizeof(json)) {
+        response_error(resp, ERR_IO);
+        return;
+    }
+    response_printf(resp, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: application/json\r\n"
+                    "Content-Length: %d\r\n\r\n"
+                    "%s", json_len, json);
+}
+
+/********************************************************************//**
+ * Runs the handler of a pictDB call (in the I/O thread or in a worker).
+ */
+static void process_request(const struct request* req, struct response* resp)
+{
+    switch (req->kind) {
+    case LIST_CALL:
+        handle_list_call(resp);
+        break;
+    case READ_CALL:
+        handle_read_call(resp, req);
+        break;
+    case INSERT_CALL:
+        handle_insert_call(resp, req);
+        break;
+    case DELETE_CALL:
+        handle_delete_call(resp, req);
+        break;
+    case STATS_CALL:
+        handle_stats_call(resp);
+        break;
+    }
+}
+
+/********************************************************************//**
+ * Sends a prepared response on the connection (I/O thread only).
+ */
+static void send_response(struct mg_connection *nc, struct response* resp)
+{
+    if (resp->has_image) {
+        //the connection is closed by the transfer, once the whole image is queued
+        send_image(nc, resp);
+        resp->has_image = 0;
     } else {
-        mg_printf(nc,   "HTTP/1.1 302 Found\r\n"
-                  "Location: http://localhost:%s/index.html\r\n", s_http_port);
+        mg_send(nc, resp->data.buf, (int) resp->data.len);
+        nc->flags |= MG_F_SEND_AND_CLOSE; //"refresh" la connexion à la page index
     }
-    nc->flags |= MG_F_SEND_AND_CLOSE; //"refresh" la connexion à la page index
+}
+
+/********************************************************************//**
+ * Frees a job and the copies it holds.
+ */
+static void free_job(struct job* job)
+{
+    if (job->response.has_image) {
+        //never sent: its connection was closed in the meantime
+        unpin_image(job->response.offset);
+    }
+    mbuf_free(&job->response.data);
+    free((char*) job->request.query);
+    free((char*) job->request.body);
+    free((char*) job->request.if_none_match);
+    free((char*) job->request.range);
+    free((char*) job->request.if_range);
+    free(job);
+}
+
+/********************************************************************//**
+ * Does nothing: mg_broadcast is only used to wake mg_mgr_poll up.
+ */
+static void wake_up_handler(struct mg_connection *nc, int ev, void *ev_data)
+{
+    (void) nc;
+    (void) ev;
+    (void) ev_data;
+}
+
+/********************************************************************//**
+ * Worker thread: handles the pending jobs and gives them back to the I/O thread.
+ */
+static void* worker_main(void* arg)
+{
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&jobs_mutex);
+        while (pending_jobs == NULL) {
+            pthread_cond_wait(&jobs_cond, &jobs_mutex);
+        }
+        struct job* job = pending_jobs;
+        pending_jobs = job->next;
+        if (pending_jobs == NULL) {
+            pending_jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&jobs_mutex);
+
+        process_request(&job->request, &job->response);
+
+        pthread_mutex_lock(&jobs_mutex);
+        job->next = done_jobs;
+        done_jobs = job;
+        pthread_mutex_unlock(&jobs_mutex);
+
+        char wake = 1;
+        mg_broadcast(&mgr, wake_up_handler, &wake, sizeof(wake));
+    }
+    return NULL;
+}
+
+/********************************************************************//**
+ * Sends the responses of the finished jobs (I/O thread only).
+ * Jobs whose connection was closed in the meantime are just dropped.
+ */
+static void deliver_done_jobs(void)
+{
+    pthread_mutex_lock(&jobs_mutex);
+    struct job* job = done_jobs;
+    done_jobs = NULL;
+    pthread_mutex_unlock(&jobs_mutex);
+
+    while (job != NULL) {
+        struct job* next = job->next;
+        for (struct mg_connection* c = mg_next(&mgr, NULL); c != NULL; c = mg_next(&mgr, c)) {
+            struct connection_state* state = c->user_data;
+            if (state != NULL && state->conn_id == job->conn_id) {
+                state->conn_id = 0;
+                send_response(c, &job->response);
+                break;
+            }
+        }
+        free_job(job);
+        job = next;
+    }
+}
+
+/********************************************************************//**
+ * Returns a '\0'-terminated copy of a part of the request (NULL if out of memory).
+ */
+static char* copy_field(const char* value, size_t len)
+{
+    char* copy = calloc(len + 1, sizeof(char));
+    if (copy != NULL && len > 0) {
+        memcpy(copy, value, len);
+    }
+    return copy;
+}
+
+/********************************************************************//**
+ * Copies the request and hands it to the worker threads.
+ */
+static void dispatch_request(struct mg_connection *nc, const struct request* req)
+{
+    struct job* job = calloc(1, sizeof(struct job));
+    char* query = copy_field(req->query, req->query_len);
+    char* body = copy_field(req->body, req->body_len);
+    //the optional headers stay NULL when they are absent
+    char* if_none_match = req->if_none_match != NULL ? copy_field(req->if_none_match, req->if_none_match_len) : NULL;
+    char* range = req->range != NULL ? copy_field(req->range, req->range_len) : NULL;
+    char* if_range = req->if_range != NULL ? copy_field(req->if_range, req->if_range_len) : NULL;
+    struct connection_state* state = connection_state(nc);
+    if (state == NULL || job == NULL || query == NULL || body == NULL || (req->if_none_match != NULL && if_none_match == NULL)
+        || (req->range != NULL && range == NULL) || (req->if_range != NULL && if_range == NULL)) {
+        free(job);
+        free(query);
+        free(body);
+        free(if_none_match);
+        free(range);
+        free(if_range);
+        mg_printf(nc, "HTTP/1.1 500 "
+                  "%s", ERROR_MESSAGES[ERR_OUT_OF_MEMORY]);
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+        return;
+    }
+    job->request = *req;
+    job->request.query = query;
+    job->request.body = body;
+    job->request.if_none_match = if_none_match;
+    job->request.range = range;
+    job->request.if_range = if_range;
+    mbuf_init(&job->response.data, 0);
+
+    job->conn_id = next_conn_id++;
+    state->conn_id = job->conn_id;
+
+    pthread_mutex_lock(&jobs_mutex);
+    if (pending_jobs_tail == NULL) {
+        pending_jobs = job;
+    } else {
+        pending_jobs_tail->next = job;
+    }
+    pending_jobs_tail = job;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
 }
 
 /********************************************************************//**
@@ -266,22 +1216,57 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data)
     struct http_message *http_m = (struct http_message *) ev_data;
 
     if (ev == MG_EV_HTTP_REQUEST) {
+        struct request req;
+        req.query = http_m->query_string.p;
+        req.query_len = http_m->query_string.len;
+        req.body = http_m->body.p;
+        req.body_len = http_m->body.len;
+        struct mg_str* if_none_match = mg_get_http_header(http_m, "If-None-Match");
+        req.if_none_match = if_none_match != NULL ? if_none_match->p : NULL;
+        req.if_none_match_len = if_none_match != NULL ? if_none_match->len : 0;
+        struct mg_str* range = mg_get_http_header(http_m, "Range");
+        req.range = range != NULL ? range->p : NULL;
+        req.range_len = range != NULL ? range->len : 0;
+        struct mg_str* if_range = mg_get_http_header(http_m, "If-Range");
+        req.if_range = if_range != NULL ? if_range->p : NULL;
+        req.if_range_len = if_range != NULL ? if_range->len : 0;
+
         if(mg_vcmp(&http_m->uri, "/pictDB/list") == 0) {
-            handle_list_call(nc);
+            req.kind = LIST_CALL;
         } else if(mg_vcmp(&http_m->uri, "/pictDB/read") == 0) {
-            handle_read_call(nc, http_m);
+            req.kind = READ_CALL;
         } else if(mg_vcmp(&http_m->uri, "/pictDB/insert") == 0) {
-            handle_insert_call(nc, http_m);
+            req.kind = INSERT_CALL;
         } else if(mg_vcmp(&http_m->uri, "/pictDB/delete") == 0) {
-            handle_delete_call(nc, http_m);
+            req.kind = DELETE_CALL;
+        } else if(mg_vcmp(&http_m->uri, "/pictDB/stats") == 0) {
+            req.kind = STATS_CALL;
         } else {
             mg_serve_http(nc, http_m, s_http_server_opts); /*Serve static content*/
+            return;
+        }
+
+        if (nb_workers > 0) {
+            dispatch_request(nc, &req);
+        } else {
+            struct response resp;
+            memset(&resp, 0, sizeof(resp));
+            mbuf_init(&resp.data, 0);
+            process_request(&req, &resp);
+            send_response(nc, &resp);
+            mbuf_free(&resp.data);
         }
+    } else if (ev == MG_EV_SEND || ev == MG_EV_POLL) {
+        //the client took some of the image: the next chunks are read
+        continue_transfer(nc);
+    } else if (ev == MG_EV_CLOSE) {
+        free_connection_state(nc);
     }
 }
 
 /********************************************************************//**
  * MAIN for pictDB_server
+ * usage: pictDB_server <dbfilename> [-workers <N>] [-derivers <N>] [-compact <BYTES>] [-cache <BYTES>]
  */
 int main (int argc, char* argv[])
 {
@@ -290,9 +1275,52 @@ int main (int argc, char* argv[])
     if (argc < 2) {
         ret = ERR_NOT_ENOUGH_ARGUMENTS;
     } else {
+        //optional number of worker threads and of background resizing threads, compaction and cache sizes
+        for (int i = 2; !ret && i < argc; i += 2) {
+            unsigned int* option = NULL;
+            unsigned long max_value = 0;
+            if (strcmp(argv[i], WORKERS_ARGUMENT) == 0) {
+                option = &nb_workers;
+                max_value = MAX_WORKERS;
+            } else if (strcmp(argv[i], DERIVERS_ARGUMENT) == 0) {
+                option = &nb_derivers;
+                max_value = MAX_DERIVE_THREADS;
+            } else if (strcmp(argv[i], COMPACT_ARGUMENT) == 0) {
+                option = &compact_step_bytes;
+                max_value = UINT32_MAX;
+            } else if (strcmp(argv[i], CACHE_ARGUMENT) == 0) {
+                option = &cache_bytes;
+                max_value = UINT32_MAX;
+            } else {
+                ret = ERR_INVALID_ARGUMENT;
+                break;
+            }
+            if (i + 1 >= argc) {
+                ret = ERR_NOT_ENOUGH_ARGUMENTS;
+                break;
+            }
+            char* endptr = NULL;
+            unsigned long value = strtoul(argv[i + 1], &endptr, 10);
+            if (endptr == argv[i + 1] || *endptr != '\0' || value > max_value) {
+                ret = ERR_INVALID_ARGUMENT;
+            } else {
+                *option = value;
+            }
+        }
+    }
+    if (!ret) {
         ret = do_open(argv[1], "r+b", &webStruct);
         if(!ret) {
+            ret = build_index(&webStruct);
+        }
+        if(!ret) {
+            //an update interrupted by a crash is replayed before serving
+            ret = journal_open(&webStruct, argv[1]);
+        }
+        if(!ret) {
+            image_cache_init(&image_cache, cache_bytes);
             print_header(&webStruct.header);
+            print_occupancy(&webStruct);
         }
     }
     if(ret) {
@@ -300,13 +1328,13 @@ int main (int argc, char* argv[])
     } else {
 
         //sourcecode of simplest_web_server from mangoose API
-        struct mg_mgr mgr;
         struct mg_connection *nc;
 
         mg_mgr_init(&mgr, NULL);
         nc = mg_bind(&mgr, s_http_port, ev_handler);
         if (nc == NULL) {
             fprintf(stderr, "Error starting server on port %s\n", s_http_port);
+            free_index(&webStruct);
             do_close(&webStruct);
             exit(1);
         }
@@ -319,19 +1347,51 @@ int main (int argc, char* argv[])
 
         //for VIPS code to work when the server is running indefinitely.
         if(VIPS_INIT(argv[0])) {
+            free_index(&webStruct);
             do_close(&webStruct);
             return ERR_VIPS;
         }
 
-        printf("Starting web server on port %s\n", s_http_port);
+        //the workers are started once vips is initialized, since they may resize images.
+        for (unsigned int i = 0; i < nb_workers; ++i) {
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, worker_main, NULL) != 0) {
+                fprintf(stderr, "Error starting worker thread %u\n", i);
+                free_index(&webStruct);
+                do_close(&webStruct);
+                exit(1);
+            }
+            pthread_detach(worker);
+        }
+        if (nb_derivers > 0 && derive_queue_start(&webStruct, nb_derivers, &db_lock) != 0) {
+            fprintf(stderr, "Error starting the background resizing threads\n");
+            free_index(&webStruct);
+            do_close(&webStruct);
+            exit(1);
+        }
+        pthread_t compactor;
+        if (compact_step_bytes > 0) {
+            if (pthread_create(&compactor, NULL, compact_main, NULL) != 0) {
+                fprintf(stderr, "Error starting the compaction thread\n");
+                free_index(&webStruct);
+                do_close(&webStruct);
+                exit(1);
+            }
+            pthread_detach(compactor);
+        }
+
+        printf("Starting web server on port %s (%u worker thread(s))\n", s_http_port, nb_workers);
         for (;;) {
             mg_mgr_poll(&mgr, 1000);
+            deliver_done_jobs();
         }
         mg_mgr_free(&mgr);
         /**TODO(when disposing time) : make it close with s_sig_received (cf mongoose/.../coap_server.c)**/
 
         vips_shutdown();
+        image_cache_free(&image_cache);
         //at the end of the webserver, we close the pictdb_file.
+        free_index(&webStruct);
         do_close(&webStruct);
     }
     return ret;